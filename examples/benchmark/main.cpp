@@ -0,0 +1,259 @@
+#include "asynctree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+typedef unsigned int uint;
+
+ast::Service service;
+
+class Timestamp
+{
+	std::chrono::high_resolution_clock::time_point time_;
+
+public:
+	Timestamp()
+		: time_(std::chrono::high_resolution_clock::now())
+	{
+	}
+
+	double operator - (const Timestamp& other) const
+	{
+		return std::chrono::duration<double, std::milli>(time_ - other.time_).count();
+	}
+};
+
+void measure(const std::string& caption, const std::function<void()>& func)
+{
+	const uint numRuns = 5;
+	double best = 0.0;
+
+	for (uint run = 0; run < numRuns; ++run)
+	{
+		const Timestamp startTime;
+		func();
+		const double elapsed = Timestamp() - startTime;
+
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	std::cout << caption << ": " << best << " ms" << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parallel for / reduce
+
+const size_t loopSize = 1 << 24;
+
+// uneven work, heavier at the end of the range
+void loopBody(std::vector<float>& data, size_t first, size_t last)
+{
+	for (size_t i = first; i < last; ++i)
+	{
+		float value = data[i];
+		const uint numIterations = 1 + uint(i * 8 / loopSize);
+
+		for (uint it = 0; it < numIterations; ++it)
+			value = std::sqrt(value + 1.f);
+
+		data[i] = value;
+	}
+}
+
+void fixedDepthSplit(std::vector<float>& data, uint depthLeft, size_t first, size_t last)
+{
+	if (depthLeft == 0)
+	{
+		loopBody(data, first, last);
+		return;
+	}
+
+	const size_t middle = first + (last - first) / 2;
+
+	service.task(ast::Light, [&data, depthLeft, first, middle]() {
+		fixedDepthSplit(data, depthLeft - 1, first, middle);
+	}).start();
+
+	service.task(ast::Light, [&data, depthLeft, middle, last]() {
+		fixedDepthSplit(data, depthLeft - 1, middle, last);
+	}).start();
+}
+
+void benchmarkParallelFor()
+{
+	std::vector<float> data(loopSize, 1.f);
+
+	measure("for: serial", [&]() {
+		loopBody(data, 0, loopSize);
+	});
+
+	for (uint depth : { 2, 4, 8 })
+	{
+		measure("for: fixed depth " + std::to_string(depth) + " split", [&]() {
+			service.task(ast::Light, [&]() {
+				fixedDepthSplit(data, depth, 0, loopSize);
+			}).start();
+			service.waitUtilEverythingIsDone();
+		});
+	}
+
+	for (size_t grain : { 1024, 16384 })
+	{
+		measure("for: parallelFor, grain " + std::to_string(grain), [&]() {
+			ast::parallelFor(service, ast::Light, ast::range<size_t>(0, loopSize), grain,
+				[&](size_t first, size_t last) {
+					loopBody(data, first, last);
+				}).start();
+			service.waitUtilEverythingIsDone();
+		});
+	}
+}
+
+void benchmarkParallelReduce()
+{
+	std::vector<double> data(loopSize);
+	for (size_t i = 0; i < loopSize; ++i)
+		data[i] = double(i % 1000) * 0.001;
+
+	const auto sumRange = [&](size_t first, size_t last, double sum) {
+		for (size_t i = first; i < last; ++i)
+			sum += data[i];
+		return sum;
+	};
+
+	double result = 0.0;
+
+	measure("reduce: serial", [&]() {
+		result = sumRange(0, loopSize, 0.0);
+	});
+
+	measure("reduce: parallelReduce, grain 16384", [&]() {
+		ast::parallelReduce(service, ast::Light, ast::range<size_t>(0, loopSize), 16384, 0.0, sumRange,
+			[](double left, double right) { return left + right; })
+		.succeeded([&](double sum) { result = sum; })
+		.start();
+		service.waitUtilEverythingIsDone();
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parallel scan
+
+void benchmarkParallelScan(size_t maxSize)
+{
+	for (size_t size = 1000000; size <= maxSize; size *= 10)
+	{
+		std::vector<uint> data(size);
+		for (size_t i = 0; i < size; ++i)
+			data[i] = uint(i % 64);
+
+		std::vector<uint> offsets(size);
+		const std::string caption = "scan " + std::to_string(size);
+
+		measure(caption + ": serial", [&]() {
+			std::exclusive_scan(data.begin(), data.end(), offsets.begin(), 0u);
+		});
+
+		measure(caption + ": parallelScan", [&]() {
+			ast::parallelScan(service, ast::Light, data.data(), data.data() + size, offsets.data(), 0u,
+				std::plus<>(), ast::ScanType::Exclusive).start();
+			service.waitUtilEverythingIsDone();
+		});
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parallel sort
+
+template <typename T, typename Compare>
+void benchmarkParallelSort(const std::string& name, Compare cmp)
+{
+	for (size_t size = 1000000; size <= 10000000; size *= 10)
+	{
+		std::vector<T> data(size);
+		for (size_t i = 0; i < size; ++i)
+			data[i] = T((i * 2654435761u) % size);
+
+		std::vector<T> sorted;
+		const std::string caption = "sort " + name + " " + std::to_string(size);
+
+		// both variants include copying of the input
+		measure(caption + ": std::sort", [&]() {
+			sorted = data;
+			std::sort(sorted.begin(), sorted.end(), cmp);
+		});
+
+		measure(caption + ": parallelSort", [&]() {
+			sorted = data;
+			ast::parallelSort(service, ast::Light, sorted.begin(), sorted.end(), cmp).start();
+			service.waitUtilEverythingIsDone();
+		});
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// mutex-guarded tasks
+
+void benchmarkMutex()
+{
+	const uint numTasks = 200000;
+	const uint numMutexes = 64;
+
+	std::vector<std::unique_ptr<ast::Mutex>> mutexes;
+	for (uint i = 0; i < numMutexes; ++i)
+		mutexes.push_back(std::make_unique<ast::Mutex>(service));
+
+	std::atomic<uint> counter(0);
+	auto work = [&]() { counter.fetch_add(1, std::memory_order_relaxed); };
+
+	auto spawn = [&](const std::function<void(uint)>& spawnOne) {
+		service.task(ast::Light, [&]() {
+			for (uint i = 0; i < numTasks; ++i)
+				spawnOne(i);
+		})
+		.start();
+		service.waitUtilEverythingIsDone();
+	};
+
+	measure("mutex: plain tasks", [&]() {
+		spawn([&](uint) { service.task(ast::Light, work).start(); });
+	});
+
+	measure("mutex: tasks on " + std::to_string(numMutexes) + " mutexes", [&]() {
+		spawn([&](uint i) { mutexes[i % numMutexes]->task(ast::Light, work).start(); });
+	});
+
+	measure("mutex: shared tasks on one mutex", [&]() {
+		spawn([&](uint) { mutexes[0]->sharedTask(ast::Light, work).start(); });
+	});
+
+	measure("mutex: exclusive tasks on one mutex", [&]() {
+		spawn([&](uint) { mutexes[0]->task(ast::Light, work).start(); });
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+	// 1e9 elements need about 8 GB, pass the maximum scan size to try it
+	const size_t maxScanSize = argc > 1 ? std::stoull(argv[1]) : 100000000;
+
+	benchmarkParallelFor();
+	benchmarkParallelReduce();
+	benchmarkParallelScan(maxScanSize);
+	benchmarkParallelSort<uint>("uint", std::less<>());
+	benchmarkParallelSort<double>("double", std::less<>());
+	benchmarkMutex();
+
+	return 0;
+}
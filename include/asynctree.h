@@ -2,5 +2,17 @@
 
 #include "asynctree_config.h"
 #include "asynctree_mutex.h"
+#include "asynctree_semaphore.h"
+#include "asynctree_event.h"
+#include "asynctree_barrier.h"
+#include "asynctree_lock_all.h"
+#include "asynctree_keyed_mutex.h"
 #include "asynctree_task.h"
-#include "asynctree_service.h"
\ No newline at end of file
+#include "asynctree_service.h"
+#include "asynctree_parallel.h"
+#include "asynctree_sort.h"
+#include "asynctree_pipeline.h"
+#include "asynctree_channel.h"
+#include "asynctree_when.h"
+#include "asynctree_shared_result.h"
+#include "asynctree_coroutine.h"
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "asynctree_config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+namespace ast
+{
+
+// Chunked bump allocator shared by all tasks of one root tree. Memory is never returned
+// to the system piecewise: every allocation holds a reference to its chunk, which is freed
+// when the owner has released the arena and the last allocation from the chunk is gone.
+// References are counted per chunk, next to its offset, so workers allocating and freeing
+// in different chunks don't share a counter.
+class Arena
+{
+	struct Chunk
+	{
+		Chunk* prev_;
+		std::size_t capacity_;
+		std::atomic<std::size_t> offset_;
+		// allocations from the chunk plus one held by the arena until it is released
+		std::atomic<uint> numRefs_;
+
+		char* data();
+	};
+
+	const std::size_t chunkSize_;
+	const bool hugePages_;
+
+	std::atomic<Chunk*> current_;
+	std::mutex growMutex_;
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+public:
+	static const std::size_t alignment = alignof(std::max_align_t);
+
+	Arena(std::size_t chunkSize, bool hugePages = false);
+
+	// must not be called after release()
+	void* allocate(std::size_t size);
+	// doesn't touch the arena itself, allocations may outlive it
+	static void deallocate(void* ptr);
+
+	// destroys the arena and drops its references to the chunks
+	void release();
+
+private:
+	~Arena() = default;
+
+	void _grow(Chunk* fullChunk, std::size_t size);
+	Chunk* _allocateChunk(std::size_t capacity);
+	static void _releaseChunk(Chunk* chunk);
+};
+
+template <typename T>
+class ArenaAllocator
+{
+	template <typename U>
+	friend class ArenaAllocator;
+
+	Arena* arena_;
+
+public:
+	typedef T value_type;
+
+	static_assert(alignof(T) <= Arena::alignment, "Type is over-aligned for the task arena");
+
+	explicit ArenaAllocator(Arena& arena) : arena_(&arena) {}
+
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena_) {}
+
+	T* allocate(std::size_t n)
+	{
+		return static_cast<T*>(arena_->allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T* ptr, std::size_t)
+	{
+		Arena::deallocate(ptr);
+	}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena_ == other.arena_; }
+
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena_ != other.arena_; }
+};
+
+}
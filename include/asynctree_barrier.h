@@ -0,0 +1,57 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task_typedefs.h"
+#include "asynctree_access_key.h"
+#include "asynctree_event.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+namespace ast
+{
+
+class Service;
+
+// Phase barrier for tasks. Every participant arrives once per phase; tasks of the next phase
+// wait in the barrier without workers and are started when the last participant arrives.
+// Next phase tasks are siblings of the arriving task, so the tree doesn't grow with phases.
+class Barrier
+{
+	std::mutex mutex_;
+	uint numParticipants_;
+	uint numArrived_;
+	std::atomic<uint> phase_;
+	const std::function<void()> onPhaseCompleted_;
+
+	// the next phase reuses the event of the previous one, whose tasks are all started
+	Event phaseEvents_[2];
+
+public:
+	// onPhaseCompleted is called by the last arriving participant before next phase tasks start
+	Barrier(Service& service, uint numParticipants, std::function<void()> onPhaseCompleted = nullptr);
+
+	uint phase() const { return phase_.load(std::memory_order_acquire); }
+
+	// arrives and returns the task continuing the participant in the next phase
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& arriveAndTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	void arrive();
+
+	// arrives and leaves, the following phases wait for one participant less
+	void arriveAndDrop();
+
+private:
+	// event of the phase arrived at
+	Event& _arrive(bool drop);
+};
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Barrier::arriveAndTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return _arrive(false)._siblingTask(KEY, weight, std::move(workFunc), std::move(callbacks)...);
+}
+
+}
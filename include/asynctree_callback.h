@@ -1,5 +1,11 @@
 #pragma once
 
+#include "asynctree_arena.h"
+
+#include <memory>
+#include <new>
+#include <type_traits>
+
 namespace ast
 {
 
@@ -7,38 +13,62 @@ enum class CallbackType : unsigned char
 {
 	Succeeded = 0,
 	Interrupted,
-	Finished
+	Finished,
+	Failed
 };
 
-template <typename TFunc>
+// Passes the task result to callbacks that accept it, moving it into callbacks that only
+// accept an rvalue. Callbacks without parameters are simply called.
+template <typename TFunc, typename... Args>
+void invokeCallback(TFunc& func, Args&... args)
+{
+	if constexpr (std::is_invocable_v<TFunc&, Args&...>)
+		func(args...);
+	else if constexpr (std::is_invocable_v<TFunc&, Args&&...>)
+		func(std::move(args)...);
+	else
+		func();
+}
+
+template <CallbackType type, typename TFunc>
 struct StaticCallback
 {
-	CallbackType type_ : 2;
 	TFunc func_;
 
-	StaticCallback(CallbackType type, TFunc func)
-		: type_(type), func_(std::move(func)) {}
+	explicit StaticCallback(TFunc func)
+		: func_(std::move(func)) {}
+
+	template <CallbackType execType, typename... Args>
+	void exec(Args&... args)
+	{
+		if constexpr (execType == type)
+			invokeCallback(func_, args...);
+	}
 };
 
-template <>
-struct StaticCallback<void> {};
+template <typename TFunc>
+StaticCallback<CallbackType::Succeeded, TFunc> succeeded(TFunc func)
+{
+	return StaticCallback<CallbackType::Succeeded, TFunc>(std::move(func));
+}
 
 template <typename TFunc>
-StaticCallback<TFunc> succeeded(TFunc func)
+StaticCallback<CallbackType::Interrupted, TFunc> interrupted(TFunc func)
 {
-	return StaticCallback<TFunc>(CallbackType::Succeeded, std::move(func));
+	return StaticCallback<CallbackType::Interrupted, TFunc>(std::move(func));
 }
 
 template <typename TFunc>
-StaticCallback<TFunc> interrupted(TFunc func)
+StaticCallback<CallbackType::Finished, TFunc> finished(TFunc func)
 {
-	return StaticCallback<TFunc>(CallbackType::Interrupted, std::move(func));
+	return StaticCallback<CallbackType::Finished, TFunc>(std::move(func));
 }
 
+// called with the std::exception_ptr thrown by the task before its interrupted callbacks
 template <typename TFunc>
-StaticCallback<TFunc> finished(TFunc func)
+StaticCallback<CallbackType::Failed, TFunc> failed(TFunc func)
 {
-	return StaticCallback<TFunc>(CallbackType::Finished, std::move(func));
+	return StaticCallback<CallbackType::Failed, TFunc>(std::move(func));
 }
 
 class DynamicCallback
@@ -61,10 +91,36 @@ public:
 	}
 };
 
+struct DynamicCallbackDeleter
+{
+	// callback was placed in the arena of its task tree when set
+	Arena* arena_ = nullptr;
+
+	void operator()(DynamicCallback* callback) const
+	{
+		if (arena_)
+		{
+			callback->~DynamicCallback();
+			Arena::deallocate(callback);
+		}
+		else
+		{
+			delete callback;
+		}
+	}
+};
+
+typedef std::unique_ptr<DynamicCallback, DynamicCallbackDeleter> DynamicCallbackP;
+
 template <typename TFunc>
-std::unique_ptr<DynamicCallbackTyped<TFunc>> makeDynamicCallback(TFunc func)
+DynamicCallbackP makeDynamicCallback(Arena* arena, TFunc func)
 {
-	return std::make_unique<DynamicCallbackTyped<TFunc>>(std::move(func));
+	if (!arena)
+		return DynamicCallbackP(new DynamicCallbackTyped<TFunc>(std::move(func)));
+
+	void* memory = arena->allocate(sizeof(DynamicCallbackTyped<TFunc>));
+	return DynamicCallbackP(new (memory) DynamicCallbackTyped<TFunc>(std::move(func)),
+		DynamicCallbackDeleter{ arena });
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace ast
+{
+
+class ChannelBase
+{
+protected:
+	// parent of the task waits for it as for a deferred one until it's released
+	static TaskImpl& _defer(Task& task);
+	static void _release(TaskImpl& task);
+
+	// interrupted tasks are finished without running
+	static void _startInterrupted(Task& task);
+	static void _releaseInterrupted(TaskImpl& task);
+
+	static void _addWaitQueue(Service& service, WaitQueue& queue);
+	static void _removeWaitQueue(Service& service, WaitQueue& queue);
+};
+
+// Bounded MPMC channel. send() and receive() called from a task never block: the continuation
+// is started at once if the operation completes, otherwise it's kept in the channel and queued
+// when space or data becomes available. Continuations are children of the calling task, so
+// that task isn't finished until they run. Capacity 0 makes every send wait for a receiver.
+// Waiting continuations of interrupted trees are finished without running, and a received
+// value whose continuation is interrupted returns to the channel.
+template <typename T>
+class Channel : ChannelBase
+{
+	struct Sender
+	{
+		T value_;
+		TaskImpl* task_;
+	};
+
+	struct Slot
+	{
+		std::optional<T> value_;
+		bool closed_ = false;
+	};
+
+	struct Receiver
+	{
+		std::shared_ptr<Slot> slot_;
+		TaskImpl* task_;
+	};
+
+	// shared with receive continuations, which can outlive the channel
+	struct State : WaitQueue
+	{
+		const std::size_t capacity_;
+
+		std::mutex mutex_;
+		bool closed_ = false;
+		std::deque<T> buffer_;
+		std::deque<Sender> senders_;
+		std::deque<Receiver> receivers_;
+
+		explicit State(std::size_t capacity)
+			: capacity_(capacity)
+		{
+		}
+
+		void _takeInterrupted(AccessKey<Service>, const CancellationToken& token,
+			std::vector<TaskImpl*>& tasks) override
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			_takeWaiters(senders_, token, tasks);
+			_takeWaiters(receivers_, token, tasks);
+		}
+
+		template <typename Waiter>
+		static void _takeWaiters(std::deque<Waiter>& waiters, const CancellationToken& token,
+			std::vector<TaskImpl*>& tasks)
+		{
+			// the predicate is applied once per waiter, so the partition is consistent
+			auto taken = std::stable_partition(waiters.begin(), waiters.end(), [&](const Waiter& waiter) {
+				return waiter.task_->cancellationToken() != &token || !waiter.task_->isInterrupted();
+			});
+
+			for (auto it = taken; it != waiters.end(); ++it)
+				tasks.push_back(it->task_);
+
+			waiters.erase(taken, waiters.end());
+		}
+	};
+
+	Service& service_;
+	const std::shared_ptr<State> state_;
+
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+public:
+	Channel(Service& service, std::size_t capacity)
+		: service_(service)
+		, state_(std::make_shared<State>(capacity))
+	{
+		_addWaitQueue(service_, *state_);
+	}
+
+	~Channel()
+	{
+		_removeWaitQueue(service_, *state_);
+		close();
+	}
+
+	// continuation() runs after value is taken by the channel, it's interrupted if the channel
+	// is closed before
+	template <typename TFunc>
+	void send(EnumTaskWeight weight, T value, TFunc continuation);
+
+	// continuation(T&) runs with the received value
+	template <typename TFunc>
+	void receive(EnumTaskWeight weight, TFunc continuation)
+	{
+		receive(weight, std::move(continuation), []() {});
+	}
+
+	// onClosed() runs instead when the channel is closed and its buffer is drained
+	template <typename TFunc, typename TClosedFunc>
+	void receive(EnumTaskWeight weight, TFunc continuation, TClosedFunc onClosed);
+
+	// Ends the stream. Waiting senders and later sends are interrupted, receivers get the
+	// buffered values and then onClosed().
+	void close();
+
+	bool isClosed()
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex_);
+		return state_->closed_;
+	}
+
+	std::size_t size()
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex_);
+		return state_->buffer_.size();
+	}
+
+private:
+	static bool _handToReceiver(State& state, T& value);
+	static void _putBack(State& state, T value);
+};
+
+// called under the lock, interrupted receivers are released without the value
+template <typename T>
+bool Channel<T>::_handToReceiver(State& state, T& value)
+{
+	while (!state.receivers_.empty())
+	{
+		Receiver receiver = std::move(state.receivers_.front());
+		state.receivers_.pop_front();
+
+		if (!receiver.task_->isInterrupted())
+			receiver.slot_->value_.emplace(std::move(value));
+
+		_release(*receiver.task_);
+
+		if (receiver.slot_->value_)
+			return true;
+	}
+
+	return false;
+}
+
+// value of an interrupted receive continuation goes to the next receiver or to the buffer front
+template <typename T>
+void Channel<T>::_putBack(State& state, T value)
+{
+	std::lock_guard<std::mutex> lock(state.mutex_);
+
+	if (!_handToReceiver(state, value))
+		state.buffer_.push_front(std::move(value));
+}
+
+template <typename T>
+template <typename TFunc>
+void Channel<T>::send(EnumTaskWeight weight, T value, TFunc continuation)
+{
+	Task& task = service_.task(weight, std::move(continuation));
+
+	State& state = *state_;
+	std::unique_lock<std::mutex> lock(state.mutex_);
+
+	if (state.closed_)
+	{
+		lock.unlock();
+		_startInterrupted(task);
+		return;
+	}
+
+	if (_handToReceiver(state, value))
+	{
+		lock.unlock();
+		task.start();
+		return;
+	}
+
+	if (state.buffer_.size() < state.capacity_)
+	{
+		state.buffer_.push_back(std::move(value));
+		lock.unlock();
+
+		task.start();
+		return;
+	}
+
+	state.senders_.push_back({ std::move(value), &_defer(task) });
+}
+
+template <typename T>
+template <typename TFunc, typename TClosedFunc>
+void Channel<T>::receive(EnumTaskWeight weight, TFunc continuation, TClosedFunc onClosed)
+{
+	auto slot = std::make_shared<Slot>();
+	std::weak_ptr<State> weakState = state_;
+
+	Task& task = service_.task(weight, [slot, _func{ std::move(continuation) }]() mutable {
+		_func(*slot->value_);
+	},
+	ast::interrupted([slot, weakState, _onClosed{ std::move(onClosed) }]() mutable {
+		if (slot->value_)
+		{
+			if (auto state = weakState.lock())
+				_putBack(*state, std::move(*slot->value_));
+		}
+		else if (slot->closed_)
+		{
+			_onClosed();
+		}
+	}));
+
+	State& state = *state_;
+	std::unique_lock<std::mutex> lock(state.mutex_);
+
+	// interrupted senders are released without sending
+	while (!state.senders_.empty() && state.senders_.front().task_->isInterrupted())
+	{
+		_release(*state.senders_.front().task_);
+		state.senders_.pop_front();
+	}
+
+	if (!state.buffer_.empty() || !state.senders_.empty())
+	{
+		TaskImpl* sender = nullptr;
+
+		if (!state.senders_.empty())
+		{
+			sender = state.senders_.front().task_;
+
+			// waiting sender takes the place of the received value
+			if (state.buffer_.empty())
+			{
+				slot->value_.emplace(std::move(state.senders_.front().value_));
+			}
+			else
+			{
+				state.buffer_.push_back(std::move(state.senders_.front().value_));
+			}
+
+			state.senders_.pop_front();
+		}
+
+		if (!slot->value_)
+		{
+			slot->value_.emplace(std::move(state.buffer_.front()));
+			state.buffer_.pop_front();
+		}
+
+		lock.unlock();
+
+		if (sender)
+			_release(*sender);
+
+		task.start();
+		return;
+	}
+
+	if (state.closed_)
+	{
+		slot->closed_ = true;
+		lock.unlock();
+
+		_startInterrupted(task);
+		return;
+	}
+
+	state.receivers_.push_back({ std::move(slot), &_defer(task) });
+}
+
+template <typename T>
+void Channel<T>::close()
+{
+	std::deque<Sender> senders;
+	std::deque<Receiver> receivers;
+
+	std::unique_lock<std::mutex> lock(state_->mutex_);
+	state_->closed_ = true;
+	senders.swap(state_->senders_);
+	receivers.swap(state_->receivers_);
+	lock.unlock();
+
+	for (Sender& sender : senders)
+		_releaseInterrupted(*sender.task_);
+
+	for (Receiver& receiver : receivers)
+	{
+		receiver.slot_->closed_ = true;
+		_releaseInterrupted(*receiver.task_);
+	}
+}
+
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+#include "asynctree_mutex.h"
+
+// the library itself is C++17, coroutines are available to C++20 users only
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace ast
+{
+
+template <typename T = void>
+class Co;
+
+// Resumes coroutines of one coroutine task. Every resumption is a new task, a child of the
+// coroutine task or of the mutex task while a lock is held, so suspended coroutines don't
+// occupy worker threads and the task tree doesn't grow with the number of suspensions.
+// While the coroutine runs, the parent is also the current task of the service, so tasks
+// it creates are children of the parent as well.
+class CoScheduler
+{
+	Service& service_;
+	const EnumTaskWeight weight_;
+	TaskImpl* parent_ = nullptr;
+
+public:
+	CoScheduler(Service& service, EnumTaskWeight weight)
+		: service_(service)
+		, weight_(weight)
+	{
+	}
+
+	EnumTaskWeight weight() const { return weight_; }
+
+	TaskImpl* _parent() const { return parent_; }
+
+	void _setParent(TaskImpl* parent)
+	{
+		// a suspended coroutine may be destroyed outside of its tasks, with a lock still held
+		if (_currentTaskImpl() == parent_)
+			service_._setCurrentTask(KEY, parent);
+
+		parent_ = parent;
+	}
+
+	// makes the current task the parent of resumptions, called from the coroutine task and
+	// from mutex tasks
+	void _enterCurrentTask()
+	{
+		parent_ = &Service::currentTask()->_impl(KEY);
+	}
+
+	// an exception escaping the coroutine fails the resumption and the coroutine task with it
+	void _resume(std::coroutine_handle<> handle)
+	{
+		auto workFunc = [this, handle]() {
+			service_._setCurrentTask(KEY, parent_);
+			handle.resume();
+		};
+
+		TaskTyped<decltype(workFunc)>::_create(KEY, service_, parent_, weight_, std::move(workFunc))->propagateFailure().start();
+	}
+
+	static TaskImpl* _currentTaskImpl()
+	{
+		Task* task = Service::currentTask();
+		return task ? &task->_impl(KEY) : nullptr;
+	}
+
+	// frames are allocated from the arena of the current task tree if it has one
+	static void* _allocateFrame(std::size_t size)
+	{
+		TaskImpl* task = _currentTaskImpl();
+		Arena* arena = task ? task->arena() : nullptr;
+
+		void* memory = arena ? arena->allocate(size + Arena::alignment) : ::operator new(size + Arena::alignment);
+		*static_cast<Arena**>(memory) = arena;
+		return static_cast<char*>(memory) + Arena::alignment;
+	}
+
+	static void _freeFrame(void* frame)
+	{
+		void* memory = static_cast<char*>(frame) - Arena::alignment;
+
+		if (*static_cast<Arena**>(memory))
+			Arena::deallocate(memory);
+		else
+			::operator delete(memory);
+	}
+};
+
+// Held while a coroutine owns a mutex. The mutex is released at the first suspension or at
+// the end of the coroutine after the lock is destroyed or unlocked. Nested locks must be
+// released in reverse order.
+class CoLock
+{
+	CoScheduler* scheduler_;
+	TaskImpl* prevParent_;
+
+public:
+	CoLock(CoScheduler& scheduler, TaskImpl* prevParent)
+		: scheduler_(&scheduler)
+		, prevParent_(prevParent)
+	{
+	}
+
+	CoLock(CoLock&& other) noexcept
+		: scheduler_(std::exchange(other.scheduler_, nullptr))
+		, prevParent_(other.prevParent_)
+	{
+	}
+
+	CoLock(const CoLock&) = delete;
+	CoLock& operator=(const CoLock&) = delete;
+
+	~CoLock() { unlock(); }
+
+	void unlock()
+	{
+		if (scheduler_)
+			std::exchange(scheduler_, nullptr)->_setParent(prevParent_);
+	}
+};
+
+// co_await on a task starts it and resumes after the task and its subtree are finished.
+// Returns whether the task succeeded, or its result if it has one.
+template <typename Result>
+class CoTaskAwaiter
+{
+	TaskOf<Result>& task_;
+	CoScheduler& scheduler_;
+	bool succeeded_ = false;
+	std::optional<std::conditional_t<std::is_void_v<Result>, bool, Result>> result_;
+
+public:
+	CoTaskAwaiter(TaskOf<Result>& task, CoScheduler& scheduler)
+		: task_(task)
+		, scheduler_(scheduler)
+	{
+	}
+
+	bool await_ready() const { return false; }
+
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		CoScheduler* scheduler = &scheduler_;
+
+		if constexpr (std::is_void_v<Result>)
+			task_.succeeded([this]() { succeeded_ = true; });
+		else
+			task_.succeeded([this](Result& result) { result_.emplace(std::move(result)); });
+
+		// the awaiter must not be touched after start(), the coroutine may be resumed already
+		task_.finished([scheduler, handle]() { scheduler->_resume(handle); });
+		task_.start();
+	}
+
+	auto await_resume()
+	{
+		if constexpr (std::is_void_v<Result>)
+			return succeeded_;
+		else
+			return std::move(result_);
+	}
+};
+
+// co_await on a mutex lock request queues a mutex task, which resumes the coroutine when
+// the mutex is acquired. Resumptions are children of the mutex task until the lock is gone.
+class CoLockAwaiter
+{
+	MutexLockRequest request_;
+	CoScheduler& scheduler_;
+	TaskImpl* prevParent_ = nullptr;
+
+public:
+	CoLockAwaiter(MutexLockRequest request, CoScheduler& scheduler)
+		: request_(request)
+		, scheduler_(scheduler)
+	{
+	}
+
+	bool await_ready() const { return false; }
+
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		// the mutex task is created under the scheduler parent, the current task
+		prevParent_ = scheduler_._parent();
+		assert(CoScheduler::_currentTaskImpl() == prevParent_);
+
+		CoScheduler* scheduler = &scheduler_;
+		auto workFunc = [scheduler, handle]() {
+			scheduler->_enterCurrentTask();
+			handle.resume();
+		};
+
+		Task& task = request_.shared_
+			? request_.mutex_.sharedTask(scheduler->weight(), std::move(workFunc))
+			: request_.mutex_.task(scheduler->weight(), std::move(workFunc));
+
+		task.propagateFailure().start();
+	}
+
+	CoLock await_resume()
+	{
+		return CoLock(scheduler_, prevParent_);
+	}
+};
+
+// co_await on another coroutine runs it inline and continues when it returns
+template <typename T>
+class CoAwaiter
+{
+	Co<T> co_;
+	CoScheduler& scheduler_;
+
+public:
+	CoAwaiter(Co<T> co, CoScheduler& scheduler)
+		: co_(std::move(co))
+		, scheduler_(scheduler)
+	{
+	}
+
+	bool await_ready() const { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle)
+	{
+		auto& promise = co_.handle_.promise();
+		promise.scheduler_ = &scheduler_;
+		promise.continuation_ = handle;
+		return co_.handle_;
+	}
+
+	T await_resume()
+	{
+		if (co_.handle_.promise().exception_)
+			std::rethrow_exception(co_.handle_.promise().exception_);
+
+		if constexpr (!std::is_void_v<T>)
+			return std::move(*co_.handle_.promise().value_);
+	}
+};
+
+class CoPromiseBase
+{
+public:
+	CoScheduler* scheduler_ = nullptr;
+	std::coroutine_handle<> continuation_;
+	std::exception_ptr exception_;
+
+	static void* operator new(std::size_t size) { return CoScheduler::_allocateFrame(size); }
+	static void operator delete(void* frame) { CoScheduler::_freeFrame(frame); }
+
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			// the outermost coroutine stays suspended until its task destroys it
+			std::coroutine_handle<> continuation = handle.promise().continuation_;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+
+	// Rethrown by co_await in the awaiting coroutine. The outermost coroutine throws it out of
+	// the resuming task, which fails the coroutine task.
+	void unhandled_exception()
+	{
+		if (!continuation_)
+			throw;
+
+		exception_ = std::current_exception();
+	}
+
+	CoTaskAwaiter<void> await_transform(Task& task)
+	{
+		return CoTaskAwaiter<void>(task, *scheduler_);
+	}
+
+	template <typename Result>
+	CoTaskAwaiter<Result> await_transform(ResultTask<Result>& task)
+	{
+		return CoTaskAwaiter<Result>(task, *scheduler_);
+	}
+
+	CoLockAwaiter await_transform(MutexLockRequest request)
+	{
+		return CoLockAwaiter(request, *scheduler_);
+	}
+
+	template <typename T>
+	CoAwaiter<T> await_transform(Co<T>&& co)
+	{
+		return CoAwaiter<T>(std::move(co), *scheduler_);
+	}
+};
+
+template <typename T>
+class CoPromise : public CoPromiseBase
+{
+public:
+	std::optional<T> value_;
+
+	Co<T> get_return_object();
+
+	template <typename U>
+	void return_value(U&& value) { value_.emplace(std::forward<U>(value)); }
+};
+
+template <>
+class CoPromise<void> : public CoPromiseBase
+{
+public:
+	Co<void> get_return_object();
+
+	void return_void() {}
+};
+
+// Coroutine running on service workers. It can co_await tasks, mutex lock requests and other
+// coroutines. Started lazily, either by co_await from another coroutine or by coTask().
+template <typename T>
+class Co
+{
+	template <typename U>
+	friend class CoAwaiter;
+
+	template <typename CoFunc>
+	friend class CoTask;
+
+public:
+	typedef CoPromise<T> promise_type;
+	typedef T ValueType;
+
+private:
+	std::coroutine_handle<promise_type> handle_;
+
+public:
+	Co() = default;
+
+	explicit Co(std::coroutine_handle<promise_type> handle)
+		: handle_(handle)
+	{
+	}
+
+	Co(Co&& other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr))
+	{
+	}
+
+	Co& operator=(Co&& other) noexcept
+	{
+		if (handle_)
+			handle_.destroy();
+
+		handle_ = std::exchange(other.handle_, nullptr);
+		return *this;
+	}
+
+	~Co()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+};
+
+template <typename T>
+Co<T> CoPromise<T>::get_return_object()
+{
+	return Co<T>(std::coroutine_handle<CoPromise<T>>::from_promise(*this));
+}
+
+inline Co<void> CoPromise<void>::get_return_object()
+{
+	return Co<void>(std::coroutine_handle<CoPromise<void>>::from_promise(*this));
+}
+
+// Task running a coroutine. It's finished after the coroutine returns and all tasks it
+// started are finished, the value of co_return is the result of the task.
+template <typename CoFunc>
+class CoTask : public TaskOf<typename std::invoke_result_t<CoFunc&>::ValueType>
+{
+	typedef typename std::invoke_result_t<CoFunc&>::ValueType T;
+
+	CoFunc func_;
+	CoScheduler scheduler_;
+	Co<T> co_;
+
+public:
+	CoTask(Service& service, TaskImpl* parent, EnumTaskWeight weight, CoFunc func)
+		: TaskOf<T>(service, parent, weight)
+		, func_(std::move(func))
+		, scheduler_(service, weight)
+	{
+	}
+
+	static std::shared_ptr<CoTask> _create(Service& service, TaskImpl* parent, EnumTaskWeight weight, CoFunc func)
+	{
+		auto task = Task::_allocate<CoTask<CoFunc>>(service, parent, weight, std::move(func));
+		task->setSelfLock(task);
+		return task;
+	}
+
+	void _execWorkFunc() override
+	{
+		scheduler_._enterCurrentTask();
+		co_ = func_();
+		co_.handle_.promise().scheduler_ = &scheduler_;
+		co_.handle_.resume();
+	}
+
+	void _execCallback(CallbackType type) override
+	{
+		if constexpr (!std::is_void_v<T>)
+		{
+			if (type == CallbackType::Succeeded && co_.handle_ && co_.handle_.done())
+				this->result_ = std::move(co_.handle_.promise().value_);
+		}
+
+		TaskOf<T>::_execCallback(type);
+	}
+};
+
+// Creates a task running the coroutine returned by func. The task is a child of the current
+// task and has to be started as usual.
+template <typename CoFunc>
+auto& coTask(Service& service, EnumTaskWeight weight, CoFunc func)
+{
+	typedef typename std::invoke_result_t<CoFunc&>::ValueType T;
+
+	TaskOf<T>& task = *CoTask<CoFunc>::_create(service, CoScheduler::_currentTaskImpl(), weight, std::move(func));
+	return task;
+}
+
+}
+
+#endif
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task_typedefs.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace ast
+{
+
+class Service;
+class TaskImpl;
+class Barrier;
+
+// Manual-reset event for tasks. Tasks started while the event isn't set wait in it in FIFO
+// order and are handed to the service by set(), so no worker is blocked while waiting.
+// Interrupted waiters are finished without waiting for set().
+class Event : public WaitQueue
+{
+	Service& service_;
+
+	std::mutex mutex_;
+	std::atomic<bool> isSet_;
+	std::atomic<bool> isCancelled_;
+	TaskImpl* firstQueuedChild_;
+	TaskImpl* lastQueuedChild_;
+
+public:
+	Event(Service& service, bool isSet = false);
+
+	// tasks still waiting are interrupted
+	~Event() override;
+
+	void set();
+	void reset();
+	bool isSet() const { return isSet_.load(std::memory_order_acquire); }
+
+	// sets the event, but waiting and later started tasks are interrupted instead of running
+	void cancel();
+	bool isCancelled() const { return isCancelled_.load(std::memory_order_acquire); }
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	// task waiting for the event as a sibling of the current task
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& _siblingTask(AccessKey<Barrier>, EnumTaskWeight weight, TaskWorkFunc workFunc,
+		Callbacks... callbacks);
+
+	void _startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl);
+	void _takeInterrupted(AccessKey<Service>, const CancellationToken& token,
+		std::vector<TaskImpl*>& tasks) override;
+
+private:
+	template <typename TaskWorkFunc, typename... Callbacks>
+	std::shared_ptr<TaskTyped<TaskWorkFunc, Callbacks...>> _task(EnumTaskWeight weight, TaskImpl* parent,
+		TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	void _queueTask(TaskImpl& task);
+	TaskImpl* _takeQueuedTasks();
+	static void _interruptTasks(TaskImpl* first);
+	void _startTasks(TaskImpl* first);
+};
+
+// Single-use countdown for tasks. Tasks wait until countDown() is called count times.
+class Latch
+{
+	std::atomic<uint> count_;
+	Event event_;
+
+public:
+	Latch(Service& service, uint count);
+
+	void countDown(uint n = 1);
+	bool isReady() const { return event_.isSet(); }
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+	{
+		return event_.rootTask(weight, std::move(workFunc), std::move(callbacks)...);
+	}
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+	{
+		return event_.task(weight, std::move(workFunc), std::move(callbacks)...);
+	}
+};
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Event::rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *_task(weight, nullptr, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Event::task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	Task* parent = Service::currentTask();
+	return *_task(weight, parent ? &parent->_impl(KEY) : nullptr, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Event::_siblingTask(AccessKey<Barrier>, EnumTaskWeight weight, TaskWorkFunc workFunc,
+	Callbacks... callbacks)
+{
+	Task* current = Service::currentTask();
+	return *_task(weight, current ? current->_impl(KEY).parent() : nullptr, std::move(workFunc),
+		std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+std::shared_ptr<TaskTyped<TaskWorkFunc, Callbacks...>> Event::_task(EnumTaskWeight weight, TaskImpl* parent,
+	TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	auto task = TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, service_, parent, weight,
+		std::move(workFunc), std::move(callbacks)...);
+	task->_impl(KEY).event_ = this;
+	return task;
+}
+
+}
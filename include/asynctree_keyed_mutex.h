@@ -0,0 +1,182 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_mutex.h"
+
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ast
+{
+
+class KeyedMutexBase
+{
+public:
+	virtual ~KeyedMutexBase() {}
+
+	// called before a task of a mutex owned by this table acquires it
+	virtual void _onTaskStarted(AccessKey<Mutex>, Mutex& mutex) = 0;
+
+	// called after a task of a mutex owned by this table released it
+	virtual void _onTaskFinished(AccessKey<Mutex>, Mutex& mutex) = 0;
+
+protected:
+	void _adopt(Mutex& mutex) { mutex._setOwner(KEY, this); }
+};
+
+// Table of mutexes serializing tasks per key. A mutex exists only while there are tasks of
+// its key, so the number of keys ever used costs nothing. The table is split into stripes
+// with their own locks, so tasks of different keys rarely contend on the table itself.
+// The table waits only for started tasks, a task which is never started keeps the entry of
+// its key alive until the table is destroyed.
+template <typename Key, typename Hash = std::hash<Key>>
+class KeyedMutex : public KeyedMutexBase
+{
+	struct Entry : Mutex
+	{
+		const Key key_;
+
+		// created and not yet started tasks, guarded by the stripe
+		uint numCreatedTasks_ = 0;
+		// started and not finished tasks, guarded by the stripe
+		uint numStartedTasks_ = 0;
+
+		Entry(Service& service, MutexPolicy policy, const Key& key)
+			: Mutex(service, policy)
+			, key_(key)
+		{
+		}
+	};
+
+	struct Stripe
+	{
+		std::mutex mutex_;
+		std::condition_variable idleCV_;
+		std::unordered_map<Key, std::unique_ptr<Entry>, Hash> entries_;
+
+		// started and not finished tasks of all entries
+		uint numStartedTasks_ = 0;
+	};
+
+	Service& service_;
+	const MutexPolicy policy_;
+	Hash hash_;
+	std::vector<Stripe> stripes_;
+
+	KeyedMutex(const KeyedMutex&) = delete;
+	KeyedMutex& operator=(const KeyedMutex&) = delete;
+
+public:
+	KeyedMutex(Service& service, MutexPolicy policy = MutexPolicy::Fifo, uint numStripes = 64)
+		: service_(service)
+		, policy_(policy)
+		, stripes_(numStripes)
+	{
+	}
+
+	~KeyedMutex()
+	{
+		for (Stripe& stripe : stripes_)
+		{
+			std::unique_lock<std::mutex> lock(stripe.mutex_);
+
+			while (stripe.numStartedTasks_)
+				stripe.idleCV_.wait(lock);
+		}
+	}
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& task(const Key& key, EnumTaskWeight weight, TaskWorkFunc workFunc,
+		Callbacks... callbacks)
+	{
+		return _acquireEntry(key).task(weight, std::move(workFunc), std::move(callbacks)...);
+	}
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& sharedTask(const Key& key, EnumTaskWeight weight, TaskWorkFunc workFunc,
+		Callbacks... callbacks)
+	{
+		return _acquireEntry(key).sharedTask(weight, std::move(workFunc), std::move(callbacks)...);
+	}
+
+	// number of keys with started and not finished tasks
+	std::size_t numActiveKeys()
+	{
+		std::size_t numKeys = 0;
+
+		for (Stripe& stripe : stripes_)
+		{
+			std::lock_guard<std::mutex> lock(stripe.mutex_);
+
+			for (auto& entry : stripe.entries_)
+				numKeys += entry.second->numStartedTasks_ ? 1 : 0;
+		}
+
+		return numKeys;
+	}
+
+	void _onTaskStarted(AccessKey<Mutex>, Mutex& mutex) override
+	{
+		Entry& entry = static_cast<Entry&>(mutex);
+		Stripe& stripe = _stripe(entry.key_);
+
+		std::lock_guard<std::mutex> lock(stripe.mutex_);
+
+		assert(entry.numCreatedTasks_ > 0);
+		--entry.numCreatedTasks_;
+		++entry.numStartedTasks_;
+		++stripe.numStartedTasks_;
+	}
+
+	void _onTaskFinished(AccessKey<Mutex>, Mutex& mutex) override
+	{
+		Entry& entry = static_cast<Entry&>(mutex);
+		Stripe& stripe = _stripe(entry.key_);
+
+		std::lock_guard<std::mutex> lock(stripe.mutex_);
+
+		--entry.numStartedTasks_;
+
+		if (--stripe.numStartedTasks_ == 0)
+			stripe.idleCV_.notify_all();
+
+		if (entry.numStartedTasks_ || entry.numCreatedTasks_)
+			return;
+
+		// key is looked up before the entry holding it is destroyed
+		stripe.entries_.erase(stripe.entries_.find(entry.key_));
+	}
+
+private:
+	Stripe& _stripe(const Key& key)
+	{
+		return stripes_[hash_(key) % stripes_.size()];
+	}
+
+	Entry& _acquireEntry(const Key& key)
+	{
+		Stripe& stripe = _stripe(key);
+
+		std::lock_guard<std::mutex> lock(stripe.mutex_);
+
+		auto& entry = stripe.entries_[key];
+
+		if (!entry)
+		{
+			entry = std::make_unique<Entry>(service_, policy_, key);
+			_adopt(*entry);
+		}
+
+		++entry->numCreatedTasks_;
+		return *entry;
+	}
+};
+
+}
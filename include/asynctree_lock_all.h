@@ -0,0 +1,96 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task_typedefs.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <initializer_list>
+#include <vector>
+
+namespace ast
+{
+
+class Mutex;
+class TaskImpl;
+
+// Acquisition of several mutexes for one task. All of them are taken at once without
+// waiting, in the order of their addresses. If one is busy, the ones taken are released and
+// the task waits in the queue of the busy one, so no lock is held while waiting.
+class MultiLock
+{
+	std::vector<Mutex*> mutexes_;
+	const bool shared_;
+
+public:
+	MultiLock(std::vector<Mutex*> mutexes, bool shared);
+
+	bool shared() const { return shared_; }
+	bool holds(const Mutex* mutex) const;
+
+	// counts the task in all the mutexes, called when the task is started
+	void _start(AccessKey<TaskImpl>);
+	// granted is the mutex which admitted the waiting task from its queue
+	void _acquire(AccessKey<TaskImpl, Mutex>, TaskImpl& task, Mutex* granted);
+	void _release(AccessKey<TaskImpl>);
+
+private:
+	void _acquire(TaskImpl& task, Mutex* granted);
+};
+
+class LockAll
+{
+	std::vector<Mutex*> mutexes_;
+
+public:
+	LockAll(std::initializer_list<Mutex*> mutexes);
+
+	// the task runs only while it holds all the mutexes
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& sharedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+private:
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& _task(bool shared, EnumTaskWeight weight, TaskWorkFunc workFunc,
+		Callbacks... callbacks);
+
+	Service& _service() const;
+};
+
+template <typename... Mutexes>
+LockAll lockAll(Mutex& mutex, Mutexes&... mutexes)
+{
+	return LockAll({ &mutex, &mutexes... });
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& LockAll::task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return _task(false, weight, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& LockAll::sharedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return _task(true, weight, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& LockAll::_task(bool shared, EnumTaskWeight weight, TaskWorkFunc workFunc,
+	Callbacks... callbacks)
+{
+	Task* parent = Service::currentTask();
+
+	auto task = TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, _service(),
+		parent ? &parent->_impl(KEY) : nullptr, weight, std::move(workFunc),
+		std::move(callbacks)...);
+	auto& taskImpl = task->_impl(KEY);
+	taskImpl.shared_ = shared;
+	taskImpl.multiLock_ = std::make_unique<MultiLock>(mutexes_, shared);
+	return *task;
+}
+
+}
@@ -3,89 +3,205 @@
 #include "asynctree_config.h"
 #include "asynctree_task_typedefs.h"
 #include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
 
+#include <atomic>
 #include <mutex>
+#include <vector>
+#include <condition_variable>
+#include <functional>
 
 namespace ast
 {
 
 class Service;
 class TaskImpl;
+class Mutex;
+class MultiLock;
+class KeyedMutexBase;
+
+// Order in which queued tasks are admitted once the mutex is released
+enum class MutexPolicy : unsigned char
+{
+	// strictly in the order of start()
+	Fifo = 0,
+	// the first waiting exclusive task goes before all waiting shared ones
+	PreferWriters,
+	// all waiting shared tasks are admitted together, exclusive ones keep their order
+	BatchReaders
+};
+
+// Awaited by coroutines to acquire a mutex, see asynctree_coroutine.h
+struct MutexLockRequest
+{
+	Mutex& mutex_;
+	const bool shared_;
+};
 
 class Mutex
 {
 	Service& service_;
+	const MutexPolicy policy_;
 
+	// Exclusive bit, waiters bit and the number of shared owners. Uncontended acquire and
+	// release are a single CAS; while the waiters bit is set both go through mutex_.
+	enum : uint
+	{
+		ExclusiveBit = 1,
+		WaitersBit = 2,
+		SharedOne = 4
+	};
+
+	std::atomic<uint> state_;
+
+	// guards the queue, the waiters bit is set while the queue isn't empty
 	std::mutex mutex_;
 	TaskImpl* firstQueuedChild_;
 	TaskImpl* lastQueuedChild_;
 
-	bool sharedTasksInProgress_;
-	uint numTasksToBeFinished_;
+	// Started and not finished tasks, also the ones still waiting for a join or for another
+	// mutex of their lockAll set. Once the destroying bit is set, it's decremented under mutex_.
+	enum : uint
+	{
+		DestroyingBit = 1u << 31
+	};
+
+	std::atomic<uint> numTasks_;
+
+	// deleted by the last released task after retire()
+	bool retired_;
+	std::function<void()> onRetired_;
+
+	// table the mutex belongs to, notified after every released task
+	KeyedMutexBase* owner_;
+
+	// multi-lock tasks admitted from the queue, they continue acquiring after mutex_ is unlocked
+	std::vector<TaskImpl*> grantedMultiLocks_;
 
 	std::condition_variable destroyCV_;
 
 public:
-	Mutex(Service& service);
-	~Mutex();
+	Mutex(Service& service, MutexPolicy policy = MutexPolicy::Fifo);
 
-	template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-	Task& rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3);
-	template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-	Task& task(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3);
-	template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-	Task& sharedRootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3);
-	template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-	Task& sharedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3);
+	// blocks until all started tasks are finished, see retire() for the non-blocking way
+	~Mutex();
 
+	// Asynchronous destruction of a mutex created with new. The mutex deletes itself and
+	// calls onRetired after its last started task is finished, or at once if it's idle. No
+	// tasks may be started with the mutex after that.
+	void retire(std::function<void()> onRetired = nullptr);
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& sharedRootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& sharedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	// Tasks declared to run under the grant of an ancestor holding the mutex. They are admitted
+	// at once and the mutex is released only after the whole subtree of the holder is finished.
+	// Exclusive grant covers both kinds of tasks, shared grant covers shared tasks only. A task
+	// without a covering grant fails with std::logic_error instead of waiting for its ancestor.
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& inheritedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& sharedInheritedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	Service& service() const { return service_; }
+
+	MutexLockRequest lock() { return { *this, false }; }
+	MutexLockRequest lockShared() { return { *this, true }; }
+
+	void _taskStarted(AccessKey<TaskImpl, MultiLock>);
 	void _startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl);
-	void _taskFinished(AccessKey<TaskImpl>);
+	void _taskFinished(AccessKey<TaskImpl>, TaskImpl& taskImpl);
+	// the mutex may be deleted in it
+	void _taskDone(AccessKey<MultiLock>);
 
-private:
-	template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-	TaskP _task(bool shared, EnumTaskWeight weight, Task* parent, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3);
+	void _setOwner(AccessKey<KeyedMutexBase>, KeyedMutexBase* owner) { owner_ = owner; }
 
-	bool _checkIfTaskCanBeStartedAndIncCounters(bool shared);
+	bool _tryLock(AccessKey<MultiLock>, bool shared);
+	void _unlock(AccessKey<MultiLock>, bool shared);
+	// queues the task if the mutex can't be acquired at once
+	bool _lockOrQueue(AccessKey<MultiLock>, TaskImpl& taskImpl);
+
+private:
+	template <typename TaskWorkFunc, typename... Callbacks>
+	std::shared_ptr<TaskTyped<TaskWorkFunc, Callbacks...>> _task(bool shared, bool inheritsGrant, EnumTaskWeight weight,
+		Task* parent, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	// exclusive or shared grant of the nearest ancestor holding the mutex
+	const TaskImpl* _findAncestorGrant(TaskImpl& task) const;
+
+	static bool _canAcquire(uint state, bool shared);
+	bool _tryAcquire(bool shared);
+	bool _tryRelease(bool shared);
+	void _release(bool shared);
+	void _removeTask();
+	void _delete();
+	bool _acquireOrQueue(TaskImpl& task);
+	void _admit(TaskImpl& task);
 	void _queueTask(TaskImpl& task);
-	bool _checkIfTaskCanBeStartedFromQueueAndStart();
+	void _startQueuedTasks();
+	void _startQueuedSharedTasks();
+	bool _startQueuedTask(TaskImpl* prev, TaskImpl& task);
 };
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-Task& Mutex::rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Mutex::rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *_task(false, false, weight, nullptr, std::move(workFunc),
+		std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Mutex::task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *_task(false, false, weight, Service::currentTask(), std::move(workFunc),
+		std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Mutex::sharedRootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	return _task(false, weight, nullptr, std::move(workFunc), 
-		std::move(t1), std::move(t2), std::move(t3))
+	return *_task(true, false, weight, nullptr, std::move(workFunc),
+		std::move(callbacks)...);
 }
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-Task& Mutex::task(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Mutex::sharedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	return _task(false, weight, Service::currentTask(), std::move(workFunc),
-		std::move(t1), std::move(t2), std::move(t3))
+	return *_task(true, false, weight, Service::currentTask(), std::move(workFunc),
+		std::move(callbacks)...);
 }
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-Task& Mutex::sharedRootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Mutex::inheritedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	return _task(true, weight, nullptr, std::move(workFunc),
-		std::move(t1), std::move(t2), std::move(t3))
+	return *_task(false, true, weight, Service::currentTask(), std::move(workFunc),
+		std::move(callbacks)...);
 }
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-Task& Mutex::sharedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Mutex::sharedInheritedTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	return _task(true, weight, Service::currentTask(), std::move(workFunc),
-		std::move(t1), std::move(t2), std::move(t3))
+	return *_task(true, true, weight, Service::currentTask(), std::move(workFunc),
+		std::move(callbacks)...);
 }
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-TaskP Mutex::_task(bool shared, EnumTaskWeight weight, Task* parent, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename TaskWorkFunc, typename... Callbacks>
+std::shared_ptr<TaskTyped<TaskWorkFunc, Callbacks...>> Mutex::_task(bool shared, bool inheritsGrant,
+	EnumTaskWeight weight, Task* parent, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	auto task = TaskTyped<TaskWorkFunc, T1, T2, T3>::_create(KEY, service_, 
-		parent ? &parent->_impl(KEY) : nullptr, weight, std::move(workFunc), std::move(t1),
-		std::move(t2), std::move(t3));
+	auto task = TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, service_,
+		parent ? &parent->_impl(KEY) : nullptr, weight, std::move(workFunc),
+		std::move(callbacks)...);
 	auto& taskImpl = task->_impl(KEY);
 	taskImpl.shared_ = shared;
+	taskImpl.inheritsGrant_ = inheritsGrant;
 	taskImpl.mutex_ = this;
 	return task;
 }
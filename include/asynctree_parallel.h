@@ -0,0 +1,297 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace ast
+{
+
+template <typename Index>
+struct Range
+{
+	typedef Index IndexType;
+
+	Index first_;
+	Index last_;
+
+	Index size() const { return last_ - first_; }
+};
+
+template <typename Index>
+Range<Index> range(Index first, Index last)
+{
+	return Range<Index>{ first, last };
+}
+
+enum class ScanType : unsigned char
+{
+	Inclusive = 0,
+	Exclusive
+};
+
+class Parallel
+{
+public:
+	// Processes the range grain by grain in the current task. Whenever the service has idle
+	// workers, the upper half of what is left is split off instead (lazy binary splitting).
+	template <typename Index, typename Chunk, typename Split>
+	static void _lazySplit(Service& service, Range<Index> range, Index grain, Chunk& chunk, Split& split);
+
+	template <typename Index, typename Body>
+	static void _for(Service& service, EnumTaskWeight weight, Range<Index> range, Index grain, Body& body);
+
+	template <typename Index, typename T, typename Ops>
+	static ResultTask<T>& _reduce(Service& service, EnumTaskWeight weight, Range<Index> range, Index grain,
+		std::shared_ptr<Ops> ops);
+
+	template <typename InputIt, typename T, typename Op>
+	static T _reduceBlock(InputIt first, InputIt last, T value, Op& op);
+
+	template <typename InputIt, typename OutputIt, typename T, typename Op>
+	static void _scanBlock(InputIt first, InputIt last, OutputIt result, T value, Op& op, ScanType type);
+};
+
+// Creates a task calling body(first, last) for subranges of at most grain elements. The task
+// is a child of the current task and has to be started as usual. Like the other parallel
+// algorithms, it fails with the first exception thrown by user code in any of its subtasks.
+template <typename Index, typename Body>
+Task& parallelFor(Service& service, EnumTaskWeight weight, Range<Index> range,
+	typename Range<Index>::IndexType grain, Body body)
+{
+	assert(grain > 0);
+
+	return service.task(weight, [&service, weight, range, grain, _body{ std::move(body) }]() mutable {
+		Parallel::_for(service, weight, range, grain, _body);
+	});
+}
+
+// Creates a task with the result of folding the range. reduce(first, last, value) folds a
+// subrange into value, join(left, right) combines results of adjacent subranges and has to
+// be associative.
+template <typename Index, typename T, typename Reduce, typename Join>
+ResultTask<T>& parallelReduce(Service& service, EnumTaskWeight weight, Range<Index> range,
+	typename Range<Index>::IndexType grain, T identity, Reduce reduce, Join join)
+{
+	assert(grain > 0);
+
+	struct Ops
+	{
+		T identity_;
+		Reduce reduce_;
+		Join join_;
+	};
+
+	return Parallel::_reduce<Index, T>(service, weight, range, grain,
+		std::make_shared<Ops>(Ops{ std::move(identity), std::move(reduce), std::move(join) }));
+}
+
+// Creates a task writing the prefix scan of [first, last) with init and the associative op
+// to result, which may be equal to first. Runs in two passes over blocks of blockSize
+// elements: block sums are reduced in parallel, then every block is scanned from its offset.
+template <typename InputIt, typename OutputIt, typename T, typename Op = std::plus<>>
+Task& parallelScan(Service& service, EnumTaskWeight weight, InputIt first, InputIt last, OutputIt result,
+	T init, Op op = Op(), ScanType type = ScanType::Inclusive, size_t blockSize = 0)
+{
+	struct Scan
+	{
+		InputIt first_;
+		OutputIt result_;
+		size_t size_;
+		size_t blockSize_;
+		size_t numBlocks_;
+		T init_;
+		Op op_;
+		ScanType type_;
+		std::vector<T> blockSums_;
+	};
+
+	const size_t size = size_t(std::distance(first, last));
+
+	if (blockSize == 0)
+		blockSize = std::max<size_t>(4096, (size + service.numThreads() * 4 - 1) / (service.numThreads() * 4));
+
+	const size_t numBlocks = (size + blockSize - 1) / blockSize;
+
+	auto scan = std::make_shared<Scan>(Scan{ first, result, size, blockSize, numBlocks, std::move(init),
+		std::move(op), type, std::vector<T>() });
+
+	return service.task(weight, [&service, weight, scan]() {
+		if (scan->numBlocks_ == 0)
+			return;
+
+		// sum of the last block is never needed
+		scan->blockSums_.resize(scan->numBlocks_ - 1, scan->init_);
+
+		service.task(weight, [&service, weight, scan]() {
+			for (size_t block = 0; block + 1 < scan->numBlocks_; ++block)
+			{
+				service.task(weight, [scan, block]() {
+					auto blockFirst = std::next(scan->first_, block * scan->blockSize_);
+					auto blockLast = std::next(blockFirst, scan->blockSize_);
+					scan->blockSums_[block] = Parallel::_reduceBlock(std::next(blockFirst), blockLast,
+						T(*blockFirst), scan->op_);
+				}).propagateFailure().start();
+			}
+		})
+		.then(weight, [&service, weight, scan]() {
+			T offset = scan->init_;
+
+			for (size_t block = 0; block < scan->numBlocks_; ++block)
+			{
+				const size_t blockOffset = block * scan->blockSize_;
+				const size_t blockSize = std::min(scan->blockSize_, scan->size_ - blockOffset);
+
+				service.task(weight, [scan, blockOffset, blockSize, offset]() {
+					auto blockFirst = std::next(scan->first_, blockOffset);
+					Parallel::_scanBlock(blockFirst, std::next(blockFirst, blockSize),
+						std::next(scan->result_, blockOffset), offset, scan->op_, scan->type_);
+				}).propagateFailure().start();
+
+				if (block + 1 < scan->numBlocks_)
+					offset = scan->op_(offset, scan->blockSums_[block]);
+			}
+		})
+		.propagateFailure()
+		.start();
+	});
+}
+
+template <typename Index, typename Chunk, typename Split>
+void Parallel::_lazySplit(Service& service, Range<Index> range, Index grain, Chunk& chunk, Split& split)
+{
+	Task* task = Service::currentTask();
+
+	while (range.size() > grain)
+	{
+		if (task->isInterrupted())
+			return;
+
+		if (service.hasIdleWorkers())
+		{
+			const Index middle = range.first_ + range.size() / 2;
+			split(Range<Index>{ middle, range.last_ });
+			range.last_ = middle;
+			continue;
+		}
+
+		chunk(Range<Index>{ range.first_, range.first_ + grain });
+		range.first_ += grain;
+	}
+
+	if (range.size() > 0 && !task->isInterrupted())
+		chunk(range);
+}
+
+template <typename Index, typename Body>
+void Parallel::_for(Service& service, EnumTaskWeight weight, Range<Index> range, Index grain, Body& body)
+{
+	// body is owned by the topmost task of the loop, which outlives all split tasks
+	auto chunk = [&body](Range<Index> subrange) {
+		body(subrange.first_, subrange.last_);
+	};
+
+	auto split = [&service, weight, grain, &body](Range<Index> upper) {
+		service.task(weight, [&service, weight, upper, grain, &body]() {
+			_for(service, weight, upper, grain, body);
+		}).propagateFailure().start();
+	};
+
+	_lazySplit(service, range, grain, chunk, split);
+}
+
+template <typename Index, typename T, typename Ops>
+ResultTask<T>& Parallel::_reduce(Service& service, EnumTaskWeight weight, Range<Index> range, Index grain,
+	std::shared_ptr<Ops> ops)
+{
+	typedef std::vector<std::shared_ptr<ResultTask<T>>> Splits;
+	auto splits = std::make_shared<Splits>();
+
+	return service.task(weight, [&service, weight, range, grain, ops, splits]() {
+		T value = ops->identity_;
+
+		auto chunk = [&ops, &value](Range<Index> subrange) {
+			value = ops->reduce_(subrange.first_, subrange.last_, std::move(value));
+		};
+
+		auto split = [&service, weight, grain, &ops, &splits](Range<Index> upper) {
+			splits->push_back(_reduce<Index, T>(service, weight, upper, grain, ops).propagateFailure().start());
+		};
+
+		_lazySplit(service, range, grain, chunk, split);
+		return value;
+	}
+	, succeeded([ops, splits](T& value) {
+		// splits are finished here; every next one covers a lower part of the range. A failed
+		// split fails this task too, so all of them have results.
+		for (auto split = splits->rbegin(); split != splits->rend(); ++split)
+		{
+			assert((*split)->hasResult());
+			value = ops->join_(std::move(value), std::move((*split)->result()));
+		}
+
+		splits->clear();
+	}));
+}
+
+template <typename InputIt, typename T, typename Op>
+T Parallel::_reduceBlock(InputIt first, InputIt last, T value, Op& op)
+{
+	constexpr bool isSum = std::is_arithmetic_v<T> &&
+		(std::is_same_v<Op, std::plus<>> || std::is_same_v<Op, std::plus<T>>) &&
+		std::is_base_of_v<std::random_access_iterator_tag, typename std::iterator_traits<InputIt>::iterator_category>;
+
+	if constexpr (isSum)
+	{
+		// independent accumulators let the compiler vectorize the loop
+		T sums[4] = { value, T(), T(), T() };
+
+		for (; std::distance(first, last) >= 4; first += 4)
+		{
+			sums[0] += first[0];
+			sums[1] += first[1];
+			sums[2] += first[2];
+			sums[3] += first[3];
+		}
+
+		value = sums[0] + sums[1] + sums[2] + sums[3];
+	}
+
+	for (; first != last; ++first)
+		value = op(value, *first);
+
+	return value;
+}
+
+template <typename InputIt, typename OutputIt, typename T, typename Op>
+void Parallel::_scanBlock(InputIt first, InputIt last, OutputIt result, T value, Op& op, ScanType type)
+{
+	if (type == ScanType::Inclusive)
+	{
+		for (; first != last; ++first, ++result)
+		{
+			value = op(value, *first);
+			*result = value;
+		}
+	}
+	else
+	{
+		for (; first != last; ++first, ++result)
+		{
+			// input may be overwritten by the output
+			T next = op(value, *first);
+			*result = value;
+			value = std::move(next);
+		}
+	}
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ast
+{
+
+enum class StageMode : unsigned char
+{
+	// items are processed concurrently
+	Parallel = 0,
+	// one item at a time, in the order they were read
+	SerialInOrder,
+	// one item at a time, in any order
+	SerialOutOfOrder
+};
+
+// Scheduling of a pipeline over tokens. Each token is a slot for one item in flight, so
+// memory stays bounded by the number of tokens no matter how slow the last stage is.
+// All tasks are children of the task returned by run(), and the bookkeeping is done at the
+// end of their work funcs, so that task is alive until the last item leaves the pipeline.
+// An exception thrown by the input or a stage fails that task and stops the pipeline.
+class PipelineBase : public std::enable_shared_from_this<PipelineBase>
+{
+	static const uint inputStage = uint(-1);
+
+	struct Stage
+	{
+		const StageMode mode_;
+		const EnumTaskWeight weight_;
+		bool busy_ = false;
+		uint nextSequence_ = 0;
+
+		// items waiting for a serial stage, sequence -> token
+		std::map<uint, uint> waiting_;
+
+		Stage(StageMode mode, EnumTaskWeight weight) : mode_(mode), weight_(weight) {}
+	};
+
+	Service& service_;
+	const EnumTaskWeight inputWeight_;
+	TaskImpl* task_ = nullptr;
+
+	std::mutex mutex_;
+	std::vector<Stage> stages_;
+	std::vector<uint> sequences_;
+	std::vector<uint> freeTokens_;
+	uint nextSequence_ = 0;
+	bool inputBusy_ = false;
+	bool inputDone_ = false;
+
+	typedef std::vector<std::pair<uint, uint>> Launches;
+
+public:
+	PipelineBase(Service& service, uint numTokens, EnumTaskWeight inputWeight);
+	virtual ~PipelineBase() {}
+
+	Task& _run(EnumTaskWeight weight);
+
+protected:
+	void _addStage(StageMode mode, EnumTaskWeight weight);
+
+	// returns false when there are no more items
+	virtual bool _readInput(uint token) = 0;
+	virtual void _execStage(uint stage, uint token) = 0;
+
+private:
+	void _start();
+	void _execInTask(uint stage, uint token);
+	void _scheduleInput(Launches& launches);
+	void _enterStage(uint stage, uint token, Launches& launches);
+	void _dispatchSerial(uint stage, Launches& launches);
+	void _launch(const Launches& launches);
+};
+
+template <typename T>
+class PipelineState : public PipelineBase
+{
+	std::vector<T> items_;
+	std::function<bool(T&)> input_;
+	std::vector<std::function<void(T&)>> stages_;
+
+public:
+	PipelineState(Service& service, uint numTokens, EnumTaskWeight inputWeight, std::function<bool(T&)> input)
+		: PipelineBase(service, numTokens, inputWeight)
+		, items_(numTokens)
+		, input_(std::move(input))
+	{
+	}
+
+	void addStage(StageMode mode, EnumTaskWeight weight, std::function<void(T&)> func)
+	{
+		_addStage(mode, weight);
+		stages_.push_back(std::move(func));
+	}
+
+protected:
+	bool _readInput(uint token) override { return input_(items_[token]); }
+	void _execStage(uint stage, uint token) override { stages_[stage](items_[token]); }
+};
+
+// Pipeline of stages over items of type T. The input func fills the item of a free token and
+// returns false when the input is exhausted; it runs serially in the order of items. Every
+// stage is a task of its weight, so the stages share the worker threads of the service.
+// Items are reused between tokens, so the input func has to overwrite them.
+template <typename T>
+class Pipeline
+{
+	std::shared_ptr<PipelineState<T>> state_;
+
+public:
+	template <typename InputFunc>
+	Pipeline(Service& service, uint numTokens, EnumTaskWeight inputWeight, InputFunc input)
+		: state_(std::make_shared<PipelineState<T>>(service, numTokens, inputWeight, std::move(input)))
+	{
+	}
+
+	template <typename StageFunc>
+	Pipeline& stage(StageMode mode, EnumTaskWeight weight, StageFunc func)
+	{
+		state_->addStage(mode, weight, std::move(func));
+		return *this;
+	}
+
+	// Creates a task which pushes all items through the stages. The task is a child of the
+	// current task and has to be started as usual. The pipeline can be destroyed after that.
+	Task& run(EnumTaskWeight weight = Light)
+	{
+		return state_->_run(weight);
+	}
+};
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task_typedefs.h"
+#include "asynctree_access_key.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <mutex>
+#include <condition_variable>
+
+namespace ast
+{
+
+class Service;
+class TaskImpl;
+
+// Counting semaphore for tasks. A task holds one permit from its start until it and its
+// subtree are finished. Tasks without a permit wait in the semaphore in FIFO order and are
+// handed to the service when a permit is released, so no worker is blocked.
+class Semaphore
+{
+	Service& service_;
+	const uint numPermits_;
+
+	std::mutex mutex_;
+	TaskImpl* firstQueuedChild_;
+	TaskImpl* lastQueuedChild_;
+
+	uint numTasksToBeFinished_;
+
+	std::condition_variable destroyCV_;
+
+public:
+	Semaphore(Service& service, uint numPermits);
+	~Semaphore();
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+	template <typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	void _startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl);
+	void _taskFinished(AccessKey<TaskImpl>);
+
+private:
+	template <typename TaskWorkFunc, typename... Callbacks>
+	std::shared_ptr<TaskTyped<TaskWorkFunc, Callbacks...>> _task(EnumTaskWeight weight, Task* parent,
+		TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	void _queueTask(TaskImpl& task);
+	bool _checkIfTaskCanBeStartedFromQueueAndStart();
+};
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Semaphore::rootTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *_task(weight, nullptr, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Semaphore::task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *_task(weight, Service::currentTask(), std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+std::shared_ptr<TaskTyped<TaskWorkFunc, Callbacks...>> Semaphore::_task(EnumTaskWeight weight, Task* parent,
+	TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	auto task = TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, service_,
+		parent ? &parent->_impl(KEY) : nullptr, weight, std::move(workFunc),
+		std::move(callbacks)...);
+	task->_impl(KEY).semaphore_ = this;
+	return task;
+}
+
+}
@@ -3,17 +3,40 @@
 #include "asynctree_config.h"
 #include "asynctree_task_typedefs.h"
 #include "asynctree_access_key.h"
+#include "asynctree_task.h"
 
+#include <atomic>
+#include <chrono>
 #include <vector>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <typeindex>
+#include <unordered_map>
 
 namespace ast
 {
 
 class Mutex;
 class TaskImpl;
+class ChannelBase;
+class Semaphore;
+class Event;
+class MultiLock;
+class Service;
+
+// Tasks started, but waiting outside of the service queues, e.g. for an event. Registered in
+// the service, so interrupted waiters are finished instead of waiting for good.
+class WaitQueue
+{
+public:
+	virtual ~WaitQueue() = default;
+
+	// unlinks interrupted tasks of the tree and appends them to tasks
+	virtual void _takeInterrupted(AccessKey<Service>, const CancellationToken& token,
+		std::vector<TaskImpl*>& tasks) = 0;
+};
 
 class Service
 {
@@ -45,10 +68,20 @@ class Service
 	TaskImpl* lastWorkerTask_ = nullptr;
 	uint numWorkingTasks_ = 0;
 
+	// queued and executing tasks, read without locking
+	std::atomic<uint> numPendingTasks_{ 0 };
+
 	bool shuttingDown_ = false;
 
 	std::condition_variable doneCV_;
 
+	std::mutex waitQueuesMutex_;
+	std::vector<WaitQueue*> waitQueues_;
+
+	// single-flight tables of sharedResultTask(), one per key and result type
+	std::mutex sharedResultsMutex_;
+	std::unordered_map<std::type_index, std::shared_ptr<void>> sharedResults_;
+
 	Service(const Service&) = delete;
 	Service& operator=(const Service&) = delete;
 
@@ -56,37 +89,81 @@ public:
 	Service(const uint numThreads = std::thread::hardware_concurrency());
 	~Service();
 
-	template <typename TaskWorkFunc, typename T1 = StaticCallback<void>, typename T2 = StaticCallback<void>, typename T3 = StaticCallback<void>>
-	inline Task& task(EnumTaskWeight weight, TaskWorkFunc workFunc,
-		T1 t1 = T1(), T2 t2 = T2(), T3 t3 = T3());
+	template <typename TaskWorkFunc, typename... Callbacks>
+	inline TaskFor<TaskWorkFunc>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	template <typename TaskWorkFunc, typename... Callbacks>
+	inline TaskFor<TaskWorkFunc>& topmostTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	// result of workFunc is converted to T
+	template <typename T, typename TaskWorkFunc, typename... Callbacks>
+	inline ResultTask<T>& task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	template <typename T, typename TaskWorkFunc, typename... Callbacks>
+	inline ResultTask<T>& topmostTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
 
-	template <typename TaskWorkFunc, typename T1 = StaticCallback<void>, typename T2 = StaticCallback<void>, typename T3 = StaticCallback<void>>
-	inline Task& topmostTask(EnumTaskWeight weight, TaskWorkFunc workFunc,
-		T1 t1 = T1(), T2 t2 = T2(), T3 t3 = T3());
+	// Single-flight task, see asynctree_shared_result.h. While a task for the key is in flight,
+	// the returned task waits for it without a worker and gets a copy of its result or failure.
+	// Flights are looked up by the key and result types only, so all call sites with equal
+	// keys of the same types share flights and results, whatever their work funcs are.
+	template <typename Key, typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& sharedResultTask(const Key& key, EnumTaskWeight weight, TaskWorkFunc workFunc,
+		Callbacks... callbacks);
+
+	// same, but a succeeded result is also reused for ttl after it's computed
+	template <typename Key, typename TaskWorkFunc, typename... Callbacks>
+	TaskFor<TaskWorkFunc>& cachedResultTask(const Key& key, std::chrono::steady_clock::duration ttl,
+		EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
 
 	void waitUtilEverythingIsDone();
 	static Task* currentTask();
 
+	uint numThreads() const { return numThreads_; }
+
+	// true if there are less queued and executing tasks than threads
+	bool hasIdleWorkers() const;
+
 	void _startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl);
-	void _addToQueue(AccessKey<Service, Mutex, TaskImpl>, TaskImpl& task);
-	void _setCurrentTask(AccessKey<TaskImpl>, TaskImpl* task);
+	void _addToQueue(AccessKey<Service, Mutex, TaskImpl, ChannelBase, Semaphore, MultiLock, Event>, TaskImpl& task);
+	void _setCurrentTask(AccessKey<TaskImpl, CoScheduler>, TaskImpl* task);
+	void _purgeInterrupted(AccessKey<TaskImpl>, CancellationToken& token);
+	void _addWaitQueue(AccessKey<Event, ChannelBase>, WaitQueue& queue);
+	void _removeWaitQueue(AccessKey<Event, ChannelBase>, WaitQueue& queue);
 
 private:
+	template <typename Table>
+	Table& _sharedResultTable();
+
 	uint _syncWorkersQueue();
 	void _moveTaskToWorkers(EnumTaskWeight weight);
+	void _unlinkFromQueue(TaskImpl& task);
+	void _linkToTree(TaskImpl& task);
+	void _unlinkFromTree(TaskImpl& task);
 	void _workerFunc();
 };
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-inline Task& Service::task(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename TaskWorkFunc, typename... Callbacks>
+inline TaskFor<TaskWorkFunc>& Service::task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, *this, currentTask_, weight, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename TaskWorkFunc, typename... Callbacks>
+inline TaskFor<TaskWorkFunc>& Service::topmostTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	return *TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, *this, nullptr, weight, std::move(workFunc), std::move(callbacks)...);
+}
+
+template <typename T, typename TaskWorkFunc, typename... Callbacks>
+inline ResultTask<T>& Service::task(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	return *TaskTyped<TaskWorkFunc, T1, T2, T3>::_create(KEY, *this, currentTask_, weight, std::move(workFunc), std::move(t1), std::move(t2), std::move(t3));
+	return task(weight, [_func{ std::move(workFunc) }]() mutable -> T { return _func(); }, std::move(callbacks)...);
 }
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-inline Task& Service::topmostTask(EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+template <typename T, typename TaskWorkFunc, typename... Callbacks>
+inline ResultTask<T>& Service::topmostTask(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 {
-	return *TaskTyped<TaskWorkFunc, T1, T2, T3>::_create(KEY, *this, nullptr, weight, std::move(workFunc), std::move(t1), std::move(t2), std::move(t3));
+	return topmostTask(weight, [_func{ std::move(workFunc) }]() mutable -> T { return _func(); }, std::move(callbacks)...);
 }
 
 }
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task_typedefs.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+#include "asynctree_event.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+
+namespace ast
+{
+
+// One computation of a shared result. Waiters are queued in the event, which is set when
+// the result or the failure is stored, or cancelled if the computing task was interrupted.
+template <typename T>
+struct SharedResult
+{
+	Event event_;
+	std::optional<T> result_;
+	std::exception_ptr exception_;
+
+	// guarded by the mutex of the table
+	bool done_ = false;
+	std::chrono::steady_clock::time_point expiresAt_;
+
+	SharedResult(Service& service) : event_(service) {}
+};
+
+// Flights by key. The service keeps one table per key and result type, shared by every call
+// site using them, so different work funcs must not use equal keys of the same types.
+template <typename Key, typename T, typename Hash = std::hash<Key>>
+class SharedResultTable
+{
+	typedef std::shared_ptr<SharedResult<T>> SharedResultP;
+	typedef std::chrono::steady_clock Clock;
+
+	std::mutex mutex_;
+	std::unordered_map<Key, SharedResultP, Hash> results_;
+
+	// expired results are purged when the table grows past it
+	std::size_t purgeSize_ = 16;
+
+public:
+	// in flight or cached result for the key, or a new one which must be computed
+	SharedResultP findOrInsert(const Key& key, Service& service, bool& inserted)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		SharedResultP& result = results_[key];
+
+		inserted = !result || (result->done_ && Clock::now() >= result->expiresAt_);
+
+		if (inserted)
+		{
+			result = std::make_shared<SharedResult<T>>(service);
+			_purgeExpired();
+		}
+
+		return result;
+	}
+
+	void complete(const Key& key, const SharedResultP& result, Clock::duration ttl)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			result->done_ = true;
+			result->expiresAt_ = Clock::now() + ttl;
+
+			// only succeeded results are cached
+			const bool cached = result->result_ && ttl > Clock::duration::zero();
+
+			auto it = results_.find(key);
+
+			if (!cached && it != results_.end() && it->second == result)
+				results_.erase(it);
+		}
+
+		if (result->result_ || result->exception_)
+			result->event_.set();
+		else
+			result->event_.cancel();
+	}
+
+private:
+	void _purgeExpired()
+	{
+		if (results_.size() < purgeSize_)
+			return;
+
+		const auto now = Clock::now();
+
+		for (auto it = results_.begin(); it != results_.end();)
+		{
+			if (it->second && it->second->done_ && now >= it->second->expiresAt_)
+				it = results_.erase(it);
+			else
+				++it;
+		}
+
+		purgeSize_ = std::max<std::size_t>(16, results_.size() * 2);
+	}
+};
+
+template <typename Table>
+Table& Service::_sharedResultTable()
+{
+	std::lock_guard<std::mutex> lock(sharedResultsMutex_);
+
+	std::shared_ptr<void>& table = sharedResults_[typeid(Table)];
+
+	if (!table)
+		table = std::make_shared<Table>();
+
+	return *static_cast<Table*>(table.get());
+}
+
+template <typename Key, typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Service::sharedResultTask(const Key& key, EnumTaskWeight weight, TaskWorkFunc workFunc,
+	Callbacks... callbacks)
+{
+	return cachedResultTask(key, std::chrono::steady_clock::duration::zero(), weight, std::move(workFunc),
+		std::move(callbacks)...);
+}
+
+template <typename Key, typename TaskWorkFunc, typename... Callbacks>
+TaskFor<TaskWorkFunc>& Service::cachedResultTask(const Key& key, std::chrono::steady_clock::duration ttl,
+	EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	typedef std::invoke_result_t<TaskWorkFunc&> T;
+	static_assert(!std::is_void_v<T>, "shared tasks must return a result");
+
+	typedef SharedResultTable<std::decay_t<Key>, T> Table;
+	Table& table = _sharedResultTable<Table>();
+
+	bool inserted = false;
+	auto result = table.findOrInsert(key, *this, inserted);
+
+	// The flight is started at once in its own tree, so interrupting the tree of the caller
+	// which started it doesn't interrupt the callers waiting in other trees.
+	if (inserted)
+	{
+		topmostTask(weight, std::move(workFunc),
+			succeeded([result](const T& value) { result->result_.emplace(value); }),
+			failed([result](std::exception_ptr exception) { result->exception_ = exception; }),
+			finished([&table, key, result, ttl]() { table.complete(key, result, ttl); })).start();
+	}
+
+	// every caller waits for the flight and copies its result, or fails with the same exception
+	return result->event_.task(weight, [result]() -> T {
+		if (result->exception_)
+			std::rethrow_exception(result->exception_);
+
+		return *result->result_;
+	},
+	std::move(callbacks)...);
+}
+
+}
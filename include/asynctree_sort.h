@@ -0,0 +1,347 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace ast
+{
+
+// Merge sort as a task tree: every node sorts its halves in child tasks into the other of two
+// arrays and then merges them back in a continuation, splitting big merges into tasks too.
+template <typename RandomIt, typename Compare>
+class ParallelMergeSort : public std::enable_shared_from_this<ParallelMergeSort<RandomIt, Compare>>
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type T;
+
+	Service& service_;
+	const EnumTaskWeight weight_;
+	const RandomIt data_;
+	std::vector<T> buffer_;
+	Compare cmp_;
+	const size_t cutoff_;
+
+public:
+	ParallelMergeSort(Service& service, EnumTaskWeight weight, RandomIt first, RandomIt last, Compare cmp,
+		size_t cutoff)
+		: service_(service)
+		, weight_(weight)
+		, data_(first)
+		, buffer_(size_t(last - first))
+		, cmp_(std::move(cmp))
+		, cutoff_(std::max<size_t>(cutoff, 2))
+	{
+	}
+
+	void _sort(size_t first, size_t last, bool toBuffer);
+
+private:
+	void _sortInTask(size_t first, size_t last, bool toBuffer);
+	void _merge(size_t first1, size_t last1, size_t first2, size_t last2, size_t out, bool fromBuffer);
+
+	template <typename SrcIt, typename DstIt>
+	void _mergeRuns(SrcIt src, DstIt dst, size_t first1, size_t last1, size_t first2, size_t last2, size_t out,
+		bool fromBuffer);
+};
+
+// LSD radix sort by bytes. Every pass counts digits of blocks in parallel, computes the
+// offsets of the blocks and scatters them in parallel, all passes chained with then().
+template <typename RandomIt>
+class ParallelRadixSort : public std::enable_shared_from_this<ParallelRadixSort<RandomIt>>
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type T;
+	typedef std::make_unsigned_t<T> Key;
+	typedef std::array<size_t, 256> Counts;
+
+	static const uint numPasses = sizeof(T);
+
+	Service& service_;
+	const EnumTaskWeight weight_;
+	const RandomIt data_;
+	const size_t size_;
+	std::vector<T> buffer_;
+	size_t blockSize_;
+	size_t numBlocks_;
+	std::vector<Counts> counts_;
+
+public:
+	ParallelRadixSort(Service& service, EnumTaskWeight weight, RandomIt first, RandomIt last);
+
+	void _sort();
+
+private:
+	static uint _digit(T value, uint pass);
+
+	void _count(uint pass);
+	void _computeOffsets();
+	void _scatter(uint pass);
+	void _copyBack();
+};
+
+// Creates a task sorting [first, last). Integer keys compared with std::less are radix sorted,
+// everything else is merge sorted with std::sort below cutoff elements. The task is a child of
+// the current task and has to be started as usual.
+template <typename RandomIt, typename Compare = std::less<>>
+Task& parallelSort(Service& service, EnumTaskWeight weight, RandomIt first, RandomIt last,
+	Compare cmp = Compare(), size_t cutoff = 4096)
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type T;
+
+	constexpr bool isRadixSortable = std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+		(std::is_same_v<Compare, std::less<>> || std::is_same_v<Compare, std::less<T>>);
+
+	const size_t size = size_t(last - first);
+
+	if (size <= cutoff)
+	{
+		return service.task(weight, [first, last, _cmp{ std::move(cmp) }]() {
+			std::sort(first, last, _cmp);
+		});
+	}
+
+	if constexpr (isRadixSortable)
+	{
+		auto sort = std::make_shared<ParallelRadixSort<RandomIt>>(service, weight, first, last);
+		return service.task(weight, [sort]() { sort->_sort(); });
+	}
+	else
+	{
+		auto sort = std::make_shared<ParallelMergeSort<RandomIt, Compare>>(service, weight, first, last,
+			std::move(cmp), cutoff);
+		return service.task(weight, [sort, size]() { sort->_sort(0, size, false); });
+	}
+}
+
+template <typename RandomIt, typename Compare>
+void ParallelMergeSort<RandomIt, Compare>::_sort(size_t first, size_t last, bool toBuffer)
+{
+	if (Service::currentTask()->isInterrupted())
+		return;
+
+	if (last - first <= cutoff_)
+	{
+		std::sort(data_ + first, data_ + last, cmp_);
+
+		if (toBuffer)
+			std::move(data_ + first, data_ + last, buffer_.begin() + first);
+
+		return;
+	}
+
+	const size_t middle = first + (last - first) / 2;
+	auto self = this->shared_from_this();
+
+	service_.task(weight_, [self, first, middle, last, toBuffer]() {
+		self->_sortInTask(first, middle, !toBuffer);
+		self->_sortInTask(middle, last, !toBuffer);
+	})
+	.then(weight_, [self, first, middle, last, toBuffer]() {
+		self->_merge(first, middle, middle, last, first, !toBuffer);
+	})
+	.propagateFailure()
+	.start();
+}
+
+template <typename RandomIt, typename Compare>
+void ParallelMergeSort<RandomIt, Compare>::_sortInTask(size_t first, size_t last, bool toBuffer)
+{
+	auto self = this->shared_from_this();
+
+	service_.task(weight_, [self, first, last, toBuffer]() {
+		self->_sort(first, last, toBuffer);
+	}).propagateFailure().start();
+}
+
+template <typename RandomIt, typename Compare>
+void ParallelMergeSort<RandomIt, Compare>::_merge(size_t first1, size_t last1, size_t first2, size_t last2,
+	size_t out, bool fromBuffer)
+{
+	if (fromBuffer)
+		_mergeRuns(buffer_.begin(), data_, first1, last1, first2, last2, out, fromBuffer);
+	else
+		_mergeRuns(data_, buffer_.begin(), first1, last1, first2, last2, out, fromBuffer);
+}
+
+template <typename RandomIt, typename Compare>
+template <typename SrcIt, typename DstIt>
+void ParallelMergeSort<RandomIt, Compare>::_mergeRuns(SrcIt src, DstIt dst, size_t first1, size_t last1,
+	size_t first2, size_t last2, size_t out, bool fromBuffer)
+{
+	if ((last1 - first1) + (last2 - first2) <= cutoff_)
+	{
+		std::merge(std::make_move_iterator(src + first1), std::make_move_iterator(src + last1),
+			std::make_move_iterator(src + first2), std::make_move_iterator(src + last2), dst + out, cmp_);
+		return;
+	}
+
+	// split the longer run in the middle and find the matching position in the other one
+	size_t middle1, middle2;
+
+	if (last1 - first1 >= last2 - first2)
+	{
+		middle1 = first1 + (last1 - first1) / 2;
+		middle2 = size_t(std::lower_bound(src + first2, src + last2, src[middle1], cmp_) - src);
+	}
+	else
+	{
+		middle2 = first2 + (last2 - first2) / 2;
+		middle1 = size_t(std::upper_bound(src + first1, src + last1, src[middle2], cmp_) - src);
+	}
+
+	const size_t outMiddle = out + (middle1 - first1) + (middle2 - first2);
+	auto self = this->shared_from_this();
+
+	service_.task(weight_, [self, first1, middle1, first2, middle2, out, fromBuffer]() {
+		self->_merge(first1, middle1, first2, middle2, out, fromBuffer);
+	}).propagateFailure().start();
+
+	service_.task(weight_, [self, middle1, last1, middle2, last2, outMiddle, fromBuffer]() {
+		self->_merge(middle1, last1, middle2, last2, outMiddle, fromBuffer);
+	}).propagateFailure().start();
+}
+
+template <typename RandomIt>
+ParallelRadixSort<RandomIt>::ParallelRadixSort(Service& service, EnumTaskWeight weight, RandomIt first,
+	RandomIt last)
+	: service_(service)
+	, weight_(weight)
+	, data_(first)
+	, size_(size_t(last - first))
+	, buffer_(size_)
+{
+	const size_t numBlocksWanted = service.numThreads() * 4;
+	blockSize_ = std::max<size_t>(16384, (size_ + numBlocksWanted - 1) / numBlocksWanted);
+	numBlocks_ = (size_ + blockSize_ - 1) / blockSize_;
+	counts_.resize(numBlocks_);
+}
+
+template <typename RandomIt>
+void ParallelRadixSort<RandomIt>::_sort()
+{
+	auto self = this->shared_from_this();
+
+	Task& chain = service_.task(weight_, [self]() { self->_count(0); });
+
+	for (uint pass = 0; pass < numPasses; ++pass)
+	{
+		if (pass > 0)
+			chain.then(weight_, [self, pass]() { self->_count(pass); });
+
+		chain.then(weight_, [self]() { self->_computeOffsets(); });
+		chain.then(weight_, [self, pass]() { self->_scatter(pass); });
+	}
+
+	// odd number of passes leaves the result in the buffer
+	if (numPasses % 2)
+		chain.then(weight_, [self]() { self->_copyBack(); });
+
+	chain.propagateFailure().start();
+}
+
+template <typename RandomIt>
+uint ParallelRadixSort<RandomIt>::_digit(T value, uint pass)
+{
+	Key key = Key(value);
+
+	// signed keys are ordered by flipping the sign bit
+	if constexpr (std::is_signed_v<T>)
+		key ^= Key(Key(1) << (sizeof(Key) * 8 - 1));
+
+	return uint(key >> (pass * 8)) & 0xFF;
+}
+
+template <typename RandomIt>
+void ParallelRadixSort<RandomIt>::_count(uint pass)
+{
+	auto self = this->shared_from_this();
+
+	for (size_t block = 0; block < numBlocks_; ++block)
+	{
+		service_.task(weight_, [self, block, pass]() {
+			Counts& counts = self->counts_[block];
+			counts.fill(0);
+
+			const size_t first = block * self->blockSize_;
+			const size_t last = std::min(first + self->blockSize_, self->size_);
+
+			if (pass % 2)
+			{
+				for (size_t i = first; i < last; ++i)
+					++counts[_digit(self->buffer_[i], pass)];
+			}
+			else
+			{
+				for (size_t i = first; i < last; ++i)
+					++counts[_digit(self->data_[i], pass)];
+			}
+		}).propagateFailure().start();
+	}
+}
+
+template <typename RandomIt>
+void ParallelRadixSort<RandomIt>::_computeOffsets()
+{
+	size_t offset = 0;
+
+	for (uint digit = 0; digit < 256; ++digit)
+	{
+		for (auto& counts : counts_)
+		{
+			const size_t count = counts[digit];
+			counts[digit] = offset;
+			offset += count;
+		}
+	}
+}
+
+template <typename RandomIt>
+void ParallelRadixSort<RandomIt>::_scatter(uint pass)
+{
+	auto self = this->shared_from_this();
+
+	for (size_t block = 0; block < numBlocks_; ++block)
+	{
+		service_.task(weight_, [self, block, pass]() {
+			Counts& offsets = self->counts_[block];
+
+			const size_t first = block * self->blockSize_;
+			const size_t last = std::min(first + self->blockSize_, self->size_);
+
+			if (pass % 2)
+			{
+				for (size_t i = first; i < last; ++i)
+					self->data_[offsets[_digit(self->buffer_[i], pass)]++] = std::move(self->buffer_[i]);
+			}
+			else
+			{
+				for (size_t i = first; i < last; ++i)
+					self->buffer_[offsets[_digit(self->data_[i], pass)]++] = std::move(self->data_[i]);
+			}
+		}).propagateFailure().start();
+	}
+}
+
+template <typename RandomIt>
+void ParallelRadixSort<RandomIt>::_copyBack()
+{
+	auto self = this->shared_from_this();
+
+	for (size_t block = 0; block < numBlocks_; ++block)
+	{
+		service_.task(weight_, [self, block]() {
+			const size_t first = block * self->blockSize_;
+			const size_t last = std::min(first + self->blockSize_, self->size_);
+			std::move(self->buffer_.begin() + first, self->buffer_.begin() + last, self->data_ + first);
+		}).propagateFailure().start();
+	}
+}
+
+}
@@ -3,24 +3,75 @@
 #include "asynctree_config.h"
 #include "asynctree_task_typedefs.h"
 #include "asynctree_access_key.h"
+#include "asynctree_arena.h"
 #include "asynctree_callback.h"
 
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <cassert>
 #include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 namespace ast
 {
 
 class Service;
 class Mutex;
+class Semaphore;
+class Event;
+class MultiLock;
+class LockAll;
 class Task;
+class TaskImpl;
+class When;
+class PipelineBase;
+class CoScheduler;
+class ChannelBase;
+
+enum class JoinMode : unsigned char
+{
+	All = 0,
+	Any
+};
+
+// Shared by all tasks of one root tree. Every interruption inside the tree bumps the
+// generation, so polling tasks walk their ancestors only after something was interrupted.
+struct CancellationToken
+{
+	std::atomic<uint> generation_{ 0 };
+
+	// Service of the root task. Its queued tasks of the tree are linked through
+	// TaskImpl::nextInTree_ under the service mutex, so purging visits only them.
+	Service& service_;
+	TaskImpl* firstQueued_ = nullptr;
+
+	explicit CancellationToken(Service& service) : service_(service) {}
+};
+
+typedef std::shared_ptr<CancellationToken> CancellationTokenP;
 
 class TaskImpl 
 {
 public:
 	// hooks and parameters for different queues in service, mutexes and tasks
 	TaskImpl* next_;
+	// service queue and queued tasks of the tree, guarded by the service mutex
+	TaskImpl* prev_;
+	TaskImpl* prevInTree_;
+	TaskImpl* nextInTree_;
 	Mutex* mutex_;
+	Semaphore* semaphore_;
+	Event* event_;
+	std::unique_ptr<MultiLock> multiLock_;
 	uint shared_ : 1;
+	// declared to run under the mutex grant of an ancestor instead of acquiring the mutex
+	uint inheritsGrant_ : 1;
+	// doesn't release the mutex: runs under an inherited grant or was rejected
+	uint inherited_ : 1;
 
 private:
 	enum class State : unsigned char
@@ -40,10 +91,44 @@ private:
 
 	State state_ : 2;
 
-	mutable uint interrupted_ : 1;
-
 	uint numChildrenToComplete_ : 20;
 
+	const CancellationTokenP cancellationToken_;
+	mutable std::atomic<bool> interrupted_;
+	std::atomic<bool> settled_;
+	mutable std::atomic<uint> checkedGeneration_;
+
+	// arena of the task tree, owned by the root task
+	Arena* arena_;
+
+	// sibling task started right after this one succeeds
+	TaskImpl* continuation_;
+
+	// thrown by the work func or propagated from a child, set once under taskMutex_
+	std::exception_ptr exception_;
+	bool propagateFailure_;
+
+	// Task which is started only after its inputs are resolved. Holds one lock for start()
+	// and one for the resolution, and counts start() as a pending input.
+	struct JoinState
+	{
+		const JoinMode mode_;
+		std::atomic<uint> numPending_{ 1 };
+		std::atomic<uint> numLocks_{ 2 };
+		std::atomic<bool> resolved_{ false };
+		std::atomic<bool> interrupted_{ false };
+
+		// guarded by taskMutex_, used to interrupt the losers of JoinMode::Any
+		std::vector<TaskW> inputs_;
+
+		JoinState(JoinMode mode) : mode_(mode) {}
+	};
+
+	std::unique_ptr<JoinState> join_;
+
+	// joined tasks to notify when this one is finished, guarded by taskMutex_ until Done
+	std::vector<TaskP> successors_;
+
 	struct WeightBuffer
 	{
 		TaskImpl* firstChild_ = nullptr;
@@ -58,13 +143,25 @@ public:
 	~TaskImpl();
 
 	Task& task() { return task_; }
+	Service& service() { return service_; }
 	TaskImpl* parent() { return parent_; }
 	EnumTaskWeight weight() const { return weight_; }
+	Arena* arena() const { return arena_; }
+	const CancellationToken* cancellationToken() const { return cancellationToken_.get(); }
+	CancellationToken* cancellationToken() { return cancellationToken_.get(); }
+	// returns false and does nothing on a child task or if the arena is already set
+	bool setArena(std::size_t chunkSize, bool hugePages);
+	const std::exception_ptr& exception() const { return exception_; }
+	void setPropagateFailure() { propagateFailure_ = true; }
 	void exec();
 	void destroy();
+	void addContinuation(TaskImpl& continuation);
 	void addChildTask(TaskImpl& child);
 	void notifyDeferredTask();
 	void addDeferredTask(TaskImpl& child);
+	void setJoin(JoinMode mode);
+	void addJoinInput(TaskImpl& input);
+	void addPredecessor(TaskImpl& predecessor);
 
 	void start();
 
@@ -72,10 +169,29 @@ public:
 	void interruptUpwards();
 	bool isInterrupted() const;
 
+	// Finishes interrupted tasks of the tree still waiting in the service queues at once, so
+	// workers don't dequeue them one by one. Must not be called under locks of tasks.
+	void purgeInterrupted();
+
+	// the task is finished as failed without running once it's queued
+	void _reject(AccessKey<Mutex>, std::exception_ptr exception) { _fail(std::move(exception)); }
+
 private:
+	void _fail(std::exception_ptr exception);
+	void _startUnjoined();
+	void _interrupt();
+	bool _syncInterruption(uint generation) const;
 	void _addChildTaskNoIncCounter(TaskImpl& child, std::unique_lock<std::mutex>& lock);
 	void _interruptWaitingTaskFromParent();
 	void _onFinished(std::unique_lock<std::mutex>& lock);
+	void _releaseLocks();
+	void _releaseContinuation(bool interrupted);
+	void _addSuccessor(TaskImpl& successor);
+	void _notifySuccessors(bool interrupted);
+	void _onJoinInputFinished(bool interrupted);
+	void _releaseJoinPending();
+	void _resolveJoin(bool interrupted);
+	void _releaseJoinLock();
 
 	void _onChildExec(EnumTaskWeight weight);
 	void _onChildFinished();
@@ -88,18 +204,25 @@ class Task : public std::enable_shared_from_this<Task>
 	TaskImpl impl_;
 	TaskP selfLock_;
 
-	std::unique_ptr<DynamicCallback> succeededCb_;
-	std::unique_ptr<DynamicCallback> interruptedCb_;
-	std::unique_ptr<DynamicCallback> finishedCb_;
+	DynamicCallbackP succeededCb_;
+	DynamicCallbackP interruptedCb_;
+	DynamicCallbackP finishedCb_;
+	DynamicCallbackP failedCb_;
 
 public:
 	Task(Service& service, TaskImpl* parent, EnumTaskWeight weight);
 	~Task();
 
-	TaskImpl& _impl(AccessKey<Service, Mutex>);
+	TaskImpl& _impl(AccessKey<Service, Mutex, Task, When, PipelineBase, CoScheduler, ChannelBase, Semaphore, LockAll, Event>);
 
 	TaskP start();
 
+	// Allocates all descendants of this root task and their callbacks from a chunked bump
+	// arena with chunks of chunkSize bytes. A chunk is freed once the tree is done and nothing
+	// allocated from it is alive.
+	// It's ignored on a child task, which uses the arena of its tree if any.
+	Task& withArena(std::size_t chunkSize, bool hugePages = false);
+
 	template <typename TFunc>
 	Task& succeeded(TFunc func);
 
@@ -108,21 +231,56 @@ public:
 
 	template <typename TFunc>
 	Task& finished(TFunc func);
+
+	// Exception escaping the work func interrupts the task and its subtree. Failed callbacks
+	// get the exception before the interrupted ones.
+	template <typename TFunc>
+	Task& failed(TFunc func);
+
+	// Failure of the task, its own or propagated from a child, fails the parent too and
+	// interrupts all its other children at once. Must be called before start().
+	Task& propagateFailure();
+
+	// valid in callbacks and after the task is finished
+	std::exception_ptr exception() const { return impl_.exception(); }
+
+	// Appends a task to the chain started by this one. It runs as a sibling after the previous
+	// task of the chain succeeds and is interrupted without running otherwise. It propagates
+	// failure if the previous task does.
+	template <typename TaskWorkFunc, typename... Callbacks>
+	Task& then(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks);
+
+	// Adds a dependency edge: the task is queued only after all its predecessors succeed and
+	// is interrupted without running as soon as one of them is interrupted. Mutex, semaphore
+	// and event tasks wait for their lock only after that. Must be called before start().
+	Task& after(Task& predecessor);
 	
 	void interruptDownwards();
 	void interruptUpwards();
 	bool isInterrupted() const;
 
 protected:
+	template <typename TTask, typename... Args>
+	static std::shared_ptr<TTask> _allocate(Service& service, TaskImpl* parent, Args&&... args);
+
 	void setSelfLock(TaskP selfLock);
 	virtual void _execWorkFunc() = 0;
 	virtual void _execCallback(CallbackType type);
 
 private:
 	template <typename TFunc>
-	Task& _callback(std::unique_ptr<DynamicCallback>& callback, TFunc func);
+	Task& _callback(DynamicCallbackP& callback, TFunc func);
 };
 
+template <typename TTask, typename... Args>
+std::shared_ptr<TTask> Task::_allocate(Service& service, TaskImpl* parent, Args&&... args)
+{
+	if (Arena* arena = parent ? parent->arena() : nullptr)
+		return std::allocate_shared<TTask>(ArenaAllocator<TTask>(*arena), service, parent, std::forward<Args>(args)...);
+
+	return std::make_shared<TTask>(service, parent, std::forward<Args>(args)...);
+}
+
 template <typename TFunc>
 Task& Task::succeeded(TFunc func)
 {
@@ -142,190 +300,197 @@ Task& Task::finished(TFunc func)
 }
 
 template <typename TFunc>
-Task& Task::_callback(std::unique_ptr<DynamicCallback>& callback, TFunc func)
+Task& Task::failed(TFunc func)
+{
+	return _callback(failedCb_, [this, _func{ std::move(func) }]() mutable {
+		std::exception_ptr exception = impl_.exception();
+		invokeCallback(_func, exception);
+	});
+}
+
+template <typename TFunc>
+Task& Task::_callback(DynamicCallbackP& callback, TFunc func)
 {
 	if (callback)
-		callback = makeDynamicCallback([_next{ std::move(func) }, _prev{ std::move(callback) }] () mutable {
+		callback = makeDynamicCallback(impl_.arena(), [_next{ std::move(func) }, _prev{ std::move(callback) }] () mutable {
 			_prev->exec();
 			_next();
 		});
 	else
-		callback = makeDynamicCallback(std::move(func));
+		callback = makeDynamicCallback(impl_.arena(), std::move(func));
 
 	return *this;
 }
 
-template <typename TaskWorkFunc, typename T1, typename T2, typename T3>
-class TaskTyped : public Task
+// Task whose work func returns a value. The value is stored inline in the task, passed to
+// succeeded callbacks and stays available through result() unless a callback consumed it
+// by rvalue reference.
+template <typename T>
+class ResultTask : public Task
 {
-	TaskWorkFunc workFunc_;
-	T1 t1_;
-	T2 t2_;
-	T3 t3_;
+protected:
+	std::optional<T> result_;
 
 public:
-	TaskTyped(Service& service, TaskImpl* parent, EnumTaskWeight weight, TaskWorkFunc workFunc,
-		T1 t1, T2 t2, T3 t3)
+	ResultTask(Service& service, TaskImpl* parent, EnumTaskWeight weight)
 		: Task(service, parent, weight)
-		, workFunc_(std::move(workFunc))
-		, t1_(std::move(t1))
-		, t2_(std::move(t2))
-		, t3_(std::move(t3))
 	{
 	}
 
-	static TaskP _create(AccessKey<Service, Mutex>, Service& service, TaskImpl* parent,
-		EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, T3 t3)
+	std::shared_ptr<ResultTask<T>> start()
 	{
-		auto task = std::make_shared<TaskTyped<TaskWorkFunc, T1, T2, T3>>(service, parent, weight, std::move(workFunc),
-			std::move(t1), std::move(t2), std::move(t3));
-		task->setSelfLock(task);
-		return task;
+		return std::static_pointer_cast<ResultTask<T>>(Task::start());
 	}
 
-	void _execWorkFunc() override
+	ResultTask<T>& withArena(std::size_t chunkSize, bool hugePages = false)
 	{
-		workFunc_();
+		Task::withArena(chunkSize, hugePages);
+		return *this;
 	}
 
-	void _execCallback(CallbackType type) override
+	template <typename TFunc>
+	ResultTask<T>& succeeded(TFunc func)
 	{
-		Task::_execCallback(type);
-
-		if (t1_.type_ == type)
-		{
-			t1_.func_();
-			return;
-		}
-
-		if (t2_.type_ == type)
-		{
-			t2_.func_();
-			return;
-		}
+		Task::succeeded([this, _func{ std::move(func) }]() mutable {
+			assert(result_);
+			invokeCallback(_func, *result_);
+		});
+		return *this;
+	}
 
-		if (t3_.type_ == type)
-		{
-			t3_.func_();
-			return;
-		}
+	template <typename TFunc>
+	ResultTask<T>& interrupted(TFunc func)
+	{
+		Task::interrupted(std::move(func));
+		return *this;
 	}
-};
 
-template <typename TaskWorkFunc, typename T1, typename T2>
-class TaskTyped<TaskWorkFunc, T1, T2, StaticCallback<void>> : public Task
-{
-	TaskWorkFunc workFunc_;
-	T1 t1_;
-	T2 t2_;
+	template <typename TFunc>
+	ResultTask<T>& finished(TFunc func)
+	{
+		Task::finished(std::move(func));
+		return *this;
+	}
 
-public:
-	TaskTyped(Service& service, TaskImpl* parent, EnumTaskWeight weight, TaskWorkFunc workFunc,
-		T1 t1, T2 t2)
-		: Task(service, parent, weight)
-		, workFunc_(std::move(workFunc))
-		, t1_(std::move(t1))
-		, t2_(std::move(t2))
+	template <typename TFunc>
+	ResultTask<T>& failed(TFunc func)
 	{
+		Task::failed(std::move(func));
+		return *this;
 	}
 
-	static TaskP _create(AccessKey<Service, Mutex>, Service& service, TaskImpl* parent,
-		EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, T2 t2, StaticCallback<void>)
+	ResultTask<T>& propagateFailure()
 	{
-		auto task = std::make_shared<TaskTyped<TaskWorkFunc, T1, T2, StaticCallback<void>>>(
-			service, parent, weight, std::move(workFunc), std::move(t1), std::move(t2));
-		task->setSelfLock(task);
-		return task;
+		Task::propagateFailure();
+		return *this;
 	}
 
-	void _execWorkFunc() override
+	template <typename TaskWorkFunc, typename... Callbacks>
+	ResultTask<T>& then(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 	{
-		workFunc_();
+		Task::then(weight, std::move(workFunc), std::move(callbacks)...);
+		return *this;
 	}
 
-	void _execCallback(CallbackType type) override
+	ResultTask<T>& after(Task& predecessor)
 	{
-		Task::_execCallback(type);
+		Task::after(predecessor);
+		return *this;
+	}
 
-		if (t1_.type_ == type)
-		{
-			t1_.func_();
-			return;
-		}
+	bool hasResult() const { return result_.has_value(); }
 
-		if (t2_.type_ == type)
-		{
-			t2_.func_();
-			return;
-		}
+	// valid after the task has succeeded, e.g. in callbacks of the parent
+	T& result()
+	{
+		assert(result_);
+		return *result_;
 	}
 };
 
-template <typename TaskWorkFunc, typename T1>
-class TaskTyped<TaskWorkFunc, T1, StaticCallback<void>, StaticCallback<void>> : public Task
+template <typename Result>
+using TaskOf = std::conditional_t<std::is_void_v<Result>, Task, ResultTask<Result>>;
+
+template <typename TaskWorkFunc>
+using TaskFor = TaskOf<std::invoke_result_t<TaskWorkFunc&>>;
+
+template <typename TaskWorkFunc, typename... Callbacks>
+class TaskTyped : public TaskFor<TaskWorkFunc>
 {
+	typedef std::invoke_result_t<TaskWorkFunc&> Result;
+
 	TaskWorkFunc workFunc_;
-	T1 t1_;
+	std::tuple<Callbacks...> callbacks_;
 
 public:
-	TaskTyped(Service& service, TaskImpl* parent, EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1)
-		: Task(service, parent, weight)
+	TaskTyped(Service& service, TaskImpl* parent, EnumTaskWeight weight, TaskWorkFunc workFunc,
+		Callbacks... callbacks)
+		: TaskFor<TaskWorkFunc>(service, parent, weight)
 		, workFunc_(std::move(workFunc))
-		, t1_(std::move(t1))
+		, callbacks_(std::move(callbacks)...)
 	{
 	}
 
-	static TaskP _create(AccessKey<Service, Mutex>, Service& service, TaskImpl* parent,
-		EnumTaskWeight weight, TaskWorkFunc workFunc, T1 t1, StaticCallback<void>, StaticCallback<void>)
+	static std::shared_ptr<TaskTyped> _create(AccessKey<Service, Mutex, Task, PipelineBase, CoScheduler, Semaphore, LockAll, Event>, Service& service, TaskImpl* parent,
+		EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
 	{
-		auto task = std::make_shared<TaskTyped<TaskWorkFunc, T1, StaticCallback<void>, StaticCallback<void>>>(
-			service, parent, weight, std::move(workFunc), std::move(t1));
+		auto task = Task::_allocate<TaskTyped<TaskWorkFunc, Callbacks...>>(service, parent, weight,
+			std::move(workFunc), std::move(callbacks)...);
 		task->setSelfLock(task);
 		return task;
 	}
 
 	void _execWorkFunc() override
 	{
-		workFunc_();
+		if constexpr (std::is_void_v<Result>)
+			workFunc_();
+		else
+			this->result_.emplace(workFunc_());
 	}
 
 	void _execCallback(CallbackType type) override
 	{
-		Task::_execCallback(type);
-
-		if (t1_.type_ == type)
+		// static callbacks are given on creation, so they run before the dynamic ones
+		switch (type)
 		{
-			t1_.func_();
-			return;
+		case CallbackType::Succeeded: _execStaticCallbacks<CallbackType::Succeeded>(); break;
+		case CallbackType::Interrupted: _execStaticCallbacks<CallbackType::Interrupted>(); break;
+		case CallbackType::Finished: _execStaticCallbacks<CallbackType::Finished>(); break;
+		case CallbackType::Failed: _execStaticCallbacks<CallbackType::Failed>(); break;
 		}
-	}
-};
-
-template <typename TaskWorkFunc>
-class TaskTyped<TaskWorkFunc, StaticCallback<void>, StaticCallback<void>, StaticCallback<void>> : public Task
-{
-	TaskWorkFunc workFunc_;
 
-public:
-	TaskTyped(Service& service, TaskImpl* parent, EnumTaskWeight weight, TaskWorkFunc workFunc)
-		: Task(service, parent, weight)
-		, workFunc_(std::move(workFunc))
-	{
-	}
-
-	static TaskP _create(AccessKey<Service, Mutex>, Service& service, TaskImpl* parent,
-		EnumTaskWeight weight, TaskWorkFunc workFunc, StaticCallback<void>, StaticCallback<void>, StaticCallback<void>)
-	{
-		auto task = std::make_shared<TaskTyped<TaskWorkFunc, StaticCallback<void>, StaticCallback<void>, StaticCallback<void>>>(
-				service, parent, weight, std::move(workFunc));
-		task->setSelfLock(task);
-		return task;
+		Task::_execCallback(type);
 	}
 
-	void _execWorkFunc() override
+private:
+	template <CallbackType type>
+	void _execStaticCallbacks()
 	{
-		workFunc_();
+		// callbacks of other types are compiled out
+		if constexpr (type == CallbackType::Succeeded && !std::is_void_v<Result>)
+		{
+			assert(this->result_);
+			std::apply([this](auto&... callbacks) { (callbacks.template exec<type>(*this->result_), ...); }, callbacks_);
+		}
+		else if constexpr (type == CallbackType::Failed)
+		{
+			std::exception_ptr exception = this->exception();
+			std::apply([&exception](auto&... callbacks) { (callbacks.template exec<type>(exception), ...); }, callbacks_);
+		}
+		else
+		{
+			std::apply([](auto&... callbacks) { (callbacks.template exec<type>(), ...); }, callbacks_);
+		}
 	}
 };
 
+template <typename TaskWorkFunc, typename... Callbacks>
+Task& Task::then(EnumTaskWeight weight, TaskWorkFunc workFunc, Callbacks... callbacks)
+{
+	auto continuation = TaskTyped<TaskWorkFunc, Callbacks...>::_create(KEY, impl_.service(), impl_.parent(),
+		weight, std::move(workFunc), std::move(callbacks)...);
+	impl_.addContinuation(continuation->_impl(KEY));
+	return *this;
+}
+
 }
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "asynctree_config.h"
+#include "asynctree_task.h"
+
+#include <initializer_list>
+
+namespace ast
+{
+
+class When
+{
+public:
+	static Task& _join(JoinMode mode, std::initializer_list<Task*> inputs);
+};
+
+// Creates a task which runs after all given tasks succeed, or is interrupted as soon as one of
+// them is interrupted. The task is a child of the current task and has to be started as usual.
+template <typename... Tasks>
+Task& whenAll(Task& task, Tasks&... tasks)
+{
+	return When::_join(JoinMode::All, { &task, &tasks... });
+}
+
+// Creates a task which runs as soon as one of the given tasks succeeds and interrupts the rest
+// of them. It is interrupted if none of them succeeds.
+template <typename... Tasks>
+Task& whenAny(Task& task, Tasks&... tasks)
+{
+	return When::_join(JoinMode::Any, { &task, &tasks... });
+}
+
+}
@@ -0,0 +1,139 @@
+#include "asynctree_arena.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace ast
+{
+namespace
+{
+
+const std::size_t hugePageSize = 2 * 1024 * 1024;
+
+std::size_t alignUp(std::size_t size, std::size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+}
+
+const std::size_t Arena::alignment;
+
+char* Arena::Chunk::data()
+{
+	return reinterpret_cast<char*>(this) + alignUp(sizeof(Chunk), Arena::alignment);
+}
+
+Arena::Arena(std::size_t chunkSize, bool hugePages)
+: chunkSize_(alignUp(std::max<std::size_t>(chunkSize, alignment), alignment))
+, hugePages_(hugePages)
+, current_(nullptr)
+{
+	Chunk* chunk = _allocateChunk(chunkSize_);
+	chunk->prev_ = nullptr;
+	current_.store(chunk, std::memory_order_release);
+}
+
+void* Arena::allocate(std::size_t size)
+{
+	// every allocation is prefixed with its chunk
+	size = alignUp(std::max<std::size_t>(size, 1), alignment) + alignment;
+
+	for (;;)
+	{
+		Chunk* chunk = current_.load(std::memory_order_acquire);
+		const std::size_t offset = chunk->offset_.fetch_add(size, std::memory_order_relaxed);
+
+		if (offset + size <= chunk->capacity_)
+		{
+			chunk->numRefs_.fetch_add(1, std::memory_order_relaxed);
+
+			char* memory = chunk->data() + offset;
+			*reinterpret_cast<Chunk**>(memory) = chunk;
+			return memory + alignment;
+		}
+
+		_grow(chunk, size);
+	}
+}
+
+void Arena::deallocate(void* ptr)
+{
+	_releaseChunk(*reinterpret_cast<Chunk**>(static_cast<char*>(ptr) - alignment));
+}
+
+void Arena::release()
+{
+	Chunk* chunk = current_.load(std::memory_order_acquire);
+	delete this;
+
+	while (chunk)
+	{
+		Chunk* prev = chunk->prev_;
+		_releaseChunk(chunk);
+		chunk = prev;
+	}
+}
+
+void Arena::_grow(Chunk* fullChunk, std::size_t size)
+{
+	std::lock_guard<std::mutex> lock(growMutex_);
+
+	// somebody else has already replaced the chunk
+	if (current_.load(std::memory_order_relaxed) != fullChunk)
+		return;
+
+	Chunk* chunk = _allocateChunk(std::max(chunkSize_, size));
+	chunk->prev_ = fullChunk;
+	current_.store(chunk, std::memory_order_release);
+}
+
+Arena::Chunk* Arena::_allocateChunk(std::size_t capacity)
+{
+	std::size_t bytes = alignUp(sizeof(Chunk), alignment) + capacity;
+	void* memory = nullptr;
+
+#ifdef __linux__
+	if (hugePages_)
+	{
+		bytes = alignUp(bytes, hugePageSize);
+
+		if (posix_memalign(&memory, hugePageSize, bytes) == 0)
+			madvise(memory, bytes, MADV_HUGEPAGE);
+		else
+			memory = nullptr;
+	}
+	else
+#endif
+	{
+		memory = std::malloc(bytes);
+	}
+
+	if (!memory)
+		throw std::bad_alloc();
+
+	Chunk* chunk = static_cast<Chunk*>(memory);
+	chunk->prev_ = nullptr;
+	chunk->capacity_ = bytes - alignUp(sizeof(Chunk), alignment);
+	new (&chunk->offset_) std::atomic<std::size_t>(0);
+	new (&chunk->numRefs_) std::atomic<uint>(1);
+	return chunk;
+}
+
+void Arena::_releaseChunk(Chunk* chunk)
+{
+	if (chunk->numRefs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	chunk->numRefs_.~atomic();
+	chunk->offset_.~atomic();
+	std::free(chunk);
+}
+
+}
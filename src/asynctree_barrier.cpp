@@ -0,0 +1,61 @@
+#include "asynctree_barrier.h"
+
+#include <cassert>
+
+namespace ast
+{
+
+Barrier::Barrier(Service& service, uint numParticipants, std::function<void()> onPhaseCompleted)
+: numParticipants_(numParticipants)
+, numArrived_(0)
+, phase_(0)
+, onPhaseCompleted_(std::move(onPhaseCompleted))
+, phaseEvents_{ { service }, { service } }
+{
+	assert(numParticipants > 0);
+}
+
+void Barrier::arrive()
+{
+	_arrive(false);
+}
+
+void Barrier::arriveAndDrop()
+{
+	_arrive(true);
+}
+
+Event& Barrier::_arrive(bool drop)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	const uint phase = phase_.load(std::memory_order_relaxed);
+	Event& event = phaseEvents_[phase % 2];
+
+	if (drop)
+	{
+		assert(numParticipants_ > numArrived_);
+		--numParticipants_;
+	}
+	else
+	{
+		++numArrived_;
+	}
+
+	if (numArrived_ < numParticipants_)
+		return event;
+
+	numArrived_ = 0;
+	phaseEvents_[(phase + 1) % 2].reset();
+	phase_.store(phase + 1, std::memory_order_release);
+
+	lock.unlock();
+
+	if (onPhaseCompleted_)
+		onPhaseCompleted_();
+
+	event.set();
+	return event;
+}
+
+}
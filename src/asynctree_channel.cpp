@@ -0,0 +1,46 @@
+#include "asynctree_channel.h"
+
+namespace ast
+{
+
+TaskImpl& ChannelBase::_defer(Task& task)
+{
+	TaskImpl& taskImpl = task._impl(KEY);
+
+	if (TaskImpl* parent = taskImpl.parent())
+		parent->notifyDeferredTask();
+
+	return taskImpl;
+}
+
+void ChannelBase::_release(TaskImpl& task)
+{
+	if (TaskImpl* parent = task.parent())
+		parent->addDeferredTask(task);
+	else
+		task.service()._addToQueue(KEY, task);
+}
+
+void ChannelBase::_startInterrupted(Task& task)
+{
+	task._impl(KEY).interruptDownwards();
+	task.start();
+}
+
+void ChannelBase::_releaseInterrupted(TaskImpl& task)
+{
+	task.interruptDownwards();
+	_release(task);
+}
+
+void ChannelBase::_addWaitQueue(Service& service, WaitQueue& queue)
+{
+	service._addWaitQueue(KEY, queue);
+}
+
+void ChannelBase::_removeWaitQueue(Service& service, WaitQueue& queue)
+{
+	service._removeWaitQueue(KEY, queue);
+}
+
+}
@@ -0,0 +1,185 @@
+#include "asynctree_event.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <cassert>
+
+namespace ast
+{
+
+Event::Event(Service& service, bool isSet)
+: service_(service)
+, isSet_(isSet)
+, isCancelled_(false)
+, firstQueuedChild_(nullptr)
+, lastQueuedChild_(nullptr)
+{
+	service_._addWaitQueue(KEY, *this);
+}
+
+Event::~Event()
+{
+	service_._removeWaitQueue(KEY, *this);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	TaskImpl* first = _takeQueuedTasks();
+	lock.unlock();
+
+	_interruptTasks(first);
+	_startTasks(first);
+}
+
+void Event::set()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	isSet_.store(true, std::memory_order_release);
+	TaskImpl* first = _takeQueuedTasks();
+	lock.unlock();
+
+	_startTasks(first);
+}
+
+void Event::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	isCancelled_.store(false, std::memory_order_relaxed);
+	isSet_.store(false, std::memory_order_release);
+}
+
+void Event::cancel()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	isCancelled_.store(true, std::memory_order_relaxed);
+	isSet_.store(true, std::memory_order_release);
+	TaskImpl* first = _takeQueuedTasks();
+	lock.unlock();
+
+	_interruptTasks(first);
+	_startTasks(first);
+}
+
+void Event::_startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl)
+{
+	auto* parentImpl = taskImpl.parent();
+
+	if (!isSet())
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+
+		// checked under the lock, otherwise the purge after the interruption can miss the task
+		if (!isSet() && !taskImpl.isInterrupted())
+		{
+			// parent waits for the queued task as for a deferred one
+			if (parentImpl)
+				parentImpl->notifyDeferredTask();
+
+			_queueTask(taskImpl);
+			return;
+		}
+	}
+
+	if (isCancelled())
+		taskImpl.interruptDownwards();
+
+	if (parentImpl)
+		parentImpl->addChildTask(taskImpl);
+	else
+		service_._addToQueue(KEY, taskImpl);
+}
+
+void Event::_queueTask(TaskImpl& task)
+{
+	task.next_ = nullptr;
+
+	if (lastQueuedChild_)
+	{
+		assert(firstQueuedChild_);
+		lastQueuedChild_->next_ = &task;
+		lastQueuedChild_ = &task;
+	}
+	else
+	{
+		assert(!firstQueuedChild_);
+		lastQueuedChild_ = firstQueuedChild_ = &task;
+	}
+}
+
+void Event::_takeInterrupted(AccessKey<Service>, const CancellationToken& token, std::vector<TaskImpl*>& tasks)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	TaskImpl* prev = nullptr;
+
+	for (TaskImpl* task = firstQueuedChild_; task;)
+	{
+		TaskImpl* next = task->next_;
+
+		if (task->cancellationToken() != &token || !task->isInterrupted())
+		{
+			prev = task;
+			task = next;
+			continue;
+		}
+
+		if (prev)
+			prev->next_ = next;
+		else
+			firstQueuedChild_ = next;
+
+		if (lastQueuedChild_ == task)
+			lastQueuedChild_ = prev;
+
+		task->next_ = nullptr;
+		tasks.push_back(task);
+		task = next;
+	}
+}
+
+TaskImpl* Event::_takeQueuedTasks()
+{
+	TaskImpl* first = firstQueuedChild_;
+	firstQueuedChild_ = lastQueuedChild_ = nullptr;
+	return first;
+}
+
+void Event::_interruptTasks(TaskImpl* first)
+{
+	// interrupted tasks are finished without running
+	for (TaskImpl* task = first; task; task = task->next_)
+		task->interruptDownwards();
+}
+
+void Event::_startTasks(TaskImpl* first)
+{
+	for (TaskImpl* task = first; task;)
+	{
+		// cache next task, because started task can be finished and deleted
+		TaskImpl* next = task->next_;
+		task->next_ = nullptr;
+
+		if (TaskImpl* parent = task->parent())
+			parent->addDeferredTask(*task);
+		else
+			service_._addToQueue(KEY, *task);
+
+		task = next;
+	}
+}
+
+Latch::Latch(Service& service, uint count)
+: count_(count)
+, event_(service, count == 0)
+{
+
+}
+
+void Latch::countDown(uint n)
+{
+	const uint prev = count_.fetch_sub(n, std::memory_order_acq_rel);
+	assert(prev >= n);
+
+	if (prev == n)
+		event_.set();
+}
+
+}
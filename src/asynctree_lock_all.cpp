@@ -0,0 +1,101 @@
+#include "asynctree_lock_all.h"
+#include "asynctree_mutex.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+
+namespace ast
+{
+
+MultiLock::MultiLock(std::vector<Mutex*> mutexes, bool shared)
+: mutexes_(std::move(mutexes))
+, shared_(shared)
+{
+	// global order keeps tasks with common mutexes from taking them in turns forever
+	std::sort(mutexes_.begin(), mutexes_.end(), std::less<Mutex*>());
+	mutexes_.erase(std::unique(mutexes_.begin(), mutexes_.end()), mutexes_.end());
+}
+
+bool MultiLock::holds(const Mutex* mutex) const
+{
+	return std::binary_search(mutexes_.begin(), mutexes_.end(), mutex, std::less<const Mutex*>());
+}
+
+void MultiLock::_acquire(AccessKey<TaskImpl, Mutex>, TaskImpl& task, Mutex* granted)
+{
+	_acquire(task, granted);
+}
+
+void MultiLock::_start(AccessKey<TaskImpl>)
+{
+	for (Mutex* mutex : mutexes_)
+		mutex->_taskStarted(KEY);
+}
+
+void MultiLock::_release(AccessKey<TaskImpl>)
+{
+	// a retired mutex may be deleted after the task is done with it
+	for (Mutex* mutex : mutexes_)
+	{
+		mutex->_unlock(KEY, shared_);
+		mutex->_taskDone(KEY);
+	}
+}
+
+void MultiLock::_acquire(TaskImpl& task, Mutex* granted)
+{
+	for (;;)
+	{
+		Mutex* busy = nullptr;
+		size_t numLocked = 0;
+
+		for (; numLocked < mutexes_.size(); ++numLocked)
+		{
+			Mutex* mutex = mutexes_[numLocked];
+
+			if (mutex != granted && !mutex->_tryLock(KEY, shared_))
+			{
+				busy = mutex;
+				break;
+			}
+		}
+
+		if (!busy)
+			break;
+
+		// back off, nothing is held while the task waits
+		for (size_t i = 0; i < numLocked; ++i)
+		{
+			if (mutexes_[i] != granted)
+				mutexes_[i]->_unlock(KEY, shared_);
+		}
+
+		if (granted)
+			granted->_unlock(KEY, shared_);
+
+		// the busy mutex calls us again when it admits the task
+		if (!busy->_lockOrQueue(KEY, task))
+			return;
+
+		granted = busy;
+	}
+
+	if (TaskImpl* parent = task.parent())
+		parent->addDeferredTask(task);
+	else
+		task.service()._addToQueue(KEY, task);
+}
+
+LockAll::LockAll(std::initializer_list<Mutex*> mutexes)
+: mutexes_(mutexes)
+{
+	assert(!mutexes_.empty());
+}
+
+Service& LockAll::_service() const
+{
+	return mutexes_.front()->service();
+}
+
+}
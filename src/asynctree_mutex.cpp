@@ -1,18 +1,24 @@
 #include "asynctree_mutex.h"
 #include "asynctree_task.h"
 #include "asynctree_service.h"
+#include "asynctree_lock_all.h"
+#include "asynctree_keyed_mutex.h"
 
 #include <cassert>
+#include <stdexcept>
 
 namespace ast
 {
 
-Mutex::Mutex(Service& service)
+Mutex::Mutex(Service& service, MutexPolicy policy)
 : service_(service)
+, policy_(policy)
+, state_(0)
 , firstQueuedChild_(nullptr)
 , lastQueuedChild_(nullptr)
-, sharedTasksInProgress_(false)
-, numTasksToBeFinished_(0)
+, numTasks_(0)
+, retired_(false)
+, owner_(nullptr)
 {
 
 }
@@ -21,69 +27,256 @@ Mutex::~Mutex()
 {
 	std::unique_lock<std::mutex> lock(mutex_);
 
-	while (numTasksToBeFinished_)
+	// force finished tasks to the slow path, which notifies us
+	numTasks_.fetch_or(DestroyingBit, std::memory_order_acq_rel);
+
+	while (numTasks_.load(std::memory_order_acquire) != DestroyingBit)
 	{
 		destroyCV_.wait(lock);
 	}
 }
 
-void Mutex::_startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl)
+void Mutex::retire(std::function<void()> onRetired)
 {
 	std::unique_lock<std::mutex> lock(mutex_);
 
-	auto* parentImpl = taskImpl.parent();
+	assert(!retired_);
+	retired_ = true;
+	onRetired_ = std::move(onRetired);
+
+	// the last finished task takes the slow path and deletes the mutex
+	if (numTasks_.fetch_or(DestroyingBit, std::memory_order_acq_rel) != 0)
+		return;
+
+	lock.unlock();
+	_delete();
+}
+
+void Mutex::_taskStarted(AccessKey<TaskImpl, MultiLock>)
+{
+	assert(!(numTasks_.load(std::memory_order_relaxed) & DestroyingBit));
+	numTasks_.fetch_add(1, std::memory_order_relaxed);
+}
 
-	if (_checkIfTaskCanBeStartedAndIncCounters(taskImpl.shared_))
+void Mutex::_startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl)
+{
+	if (owner_)
+		owner_->_onTaskStarted(KEY, *this);
+
+	taskImpl.inherited_ = taskImpl.inheritsGrant_;
+
+	if (taskImpl.inheritsGrant_)
 	{
-		lock.unlock();
+		const TaskImpl* grant = _findAncestorGrant(taskImpl);
 
-		if (parentImpl)
-		{
-			parentImpl->addChildTask(taskImpl);
-		}
+		// exclusive task under a shared grant would wait for its own ancestor forever
+		if (!grant)
+			taskImpl._reject(KEY, std::make_exception_ptr(std::logic_error("no ancestor holds the mutex")));
+		else if (grant->shared_ && !taskImpl.shared_)
+			taskImpl._reject(KEY, std::make_exception_ptr(std::logic_error("exclusive task under a shared grant")));
+
+		_admit(taskImpl);
+		return;
+	}
+
+	if (_tryAcquire(taskImpl.shared_))
+	{
+		_admit(taskImpl);
+		return;
+	}
+
+	// parent waits for the queued task as for a deferred one
+	if (TaskImpl* parentImpl = taskImpl.parent())
+		parentImpl->notifyDeferredTask();
+
+	if (_acquireOrQueue(taskImpl))
+	{
+		if (TaskImpl* parentImpl = taskImpl.parent())
+			parentImpl->addDeferredTask(taskImpl);
 		else
-		{
 			service_._addToQueue(KEY, taskImpl);
-		}
 	}
-	else
+}
+
+void Mutex::_taskFinished(AccessKey<TaskImpl>, TaskImpl& taskImpl)
+{
+	const bool shared = taskImpl.shared_;
+	KeyedMutexBase* owner = owner_;
+
+	if (!taskImpl.inherited_ && !_tryRelease(shared))
+		_release(shared);
+
+	// keyed mutexes aren't retired, but the owner may destroy the mutex
+	_removeTask();
+
+	if (owner)
+		owner->_onTaskFinished(KEY, *this);
+}
+
+void Mutex::_taskDone(AccessKey<MultiLock>)
+{
+	_removeTask();
+}
+
+void Mutex::_removeTask()
+{
+	uint numTasks = numTasks_.load(std::memory_order_relaxed);
+
+	// nobody waits for the last task
+	while (!(numTasks & DestroyingBit))
 	{
-		if (parentImpl)
+		if (numTasks_.compare_exchange_weak(numTasks, numTasks - 1, std::memory_order_release,
+			std::memory_order_relaxed))
+			return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	numTasks = numTasks_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+
+	// decided under the lock, so only one finished task deletes the mutex
+	const bool deleteMutex = retired_ && numTasks == DestroyingBit;
+
+	// notified under the lock, a blocked destructor may free the mutex right after it
+	destroyCV_.notify_one();
+	lock.unlock();
+
+	if (deleteMutex)
+		_delete();
+}
+
+bool Mutex::_tryLock(AccessKey<MultiLock>, bool shared)
+{
+	return _tryAcquire(shared);
+}
+
+void Mutex::_unlock(AccessKey<MultiLock>, bool shared)
+{
+	if (!_tryRelease(shared))
+		_release(shared);
+}
+
+bool Mutex::_lockOrQueue(AccessKey<MultiLock>, TaskImpl& taskImpl)
+{
+	return _tryAcquire(taskImpl.shared_) || _acquireOrQueue(taskImpl);
+}
+
+bool Mutex::_acquireOrQueue(TaskImpl& task)
+{
+	const bool shared = task.shared_;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	uint state = state_.load(std::memory_order_acquire);
+
+	for (;;)
+	{
+		if (!firstQueuedChild_ && _canAcquire(state, shared))
 		{
-			_queueTask(taskImpl);
+			const uint acquired = state + (shared ? SharedOne : ExclusiveBit);
+
+			if (state_.compare_exchange_weak(state, acquired, std::memory_order_acquire))
+				return true;
 		}
-		else
+		else if (state_.compare_exchange_weak(state, state | WaitersBit, std::memory_order_acq_rel))
 		{
-			parentImpl->notifyDeferredTask();
-			_queueTask(taskImpl);
+			break;
 		}
+	}
 
-		lock.unlock();
+	_queueTask(task);
+	return false;
+}
+
+const TaskImpl* Mutex::_findAncestorGrant(TaskImpl& task) const
+{
+	// ancestors are alive and keep their grants while their subtree isn't finished,
+	// inherited ones are skipped to find the task which really holds the mutex
+	for (TaskImpl* ancestor = task.parent(); ancestor; ancestor = ancestor->parent())
+	{
+		if ((ancestor->mutex_ == this && !ancestor->inherited_) ||
+			(ancestor->multiLock_ && ancestor->multiLock_->holds(this)))
+			return ancestor;
 	}
+
+	return nullptr;
 }
 
-void Mutex::_taskFinished(AccessKey<TaskImpl>)
+bool Mutex::_canAcquire(uint state, bool shared)
 {
-	std::unique_lock<std::mutex> lock(mutex_);
+	if (state & ExclusiveBit)
+		return false;
 
-	--numTasksToBeFinished_;
+	return shared || state < SharedOne;
+}
 
-	while (_checkIfTaskCanBeStartedFromQueueAndStart()) {}
+bool Mutex::_tryAcquire(bool shared)
+{
+	uint state = state_.load(std::memory_order_relaxed);
 
-	lock.unlock();
-	destroyCV_.notify_one();
+	for (;;)
+	{
+		// waiters are served first
+		if ((state & WaitersBit) || !_canAcquire(state, shared))
+			return false;
+
+		const uint acquired = state + (shared ? SharedOne : ExclusiveBit);
+
+		if (state_.compare_exchange_weak(state, acquired, std::memory_order_acquire, std::memory_order_relaxed))
+			return true;
+	}
 }
 
-bool Mutex::_checkIfTaskCanBeStartedAndIncCounters(bool shared)
+bool Mutex::_tryRelease(bool shared)
 {
-	if (numTasksToBeFinished_ == 0 || (shared && sharedTasksInProgress_ && !firstQueuedChild_))
+	uint state = state_.load(std::memory_order_relaxed);
+
+	for (;;)
 	{
-		++numTasksToBeFinished_;
-		sharedTasksInProgress_ = shared;
-		return true;
+		const uint released = state - (shared ? SharedOne : ExclusiveBit);
+
+		// the last owner admits waiters
+		if ((state & WaitersBit) && (released & ~uint(WaitersBit)) == 0)
+			return false;
+
+		if (state_.compare_exchange_weak(state, released, std::memory_order_release, std::memory_order_relaxed))
+			return true;
 	}
+}
 
-	return false;
+void Mutex::_release(bool shared)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	state_.fetch_sub(shared ? SharedOne : ExclusiveBit, std::memory_order_acq_rel);
+
+	_startQueuedTasks();
+
+	std::vector<TaskImpl*> grantedMultiLocks;
+	grantedMultiLocks.swap(grantedMultiLocks_);
+
+	lock.unlock();
+
+	// the granted tasks are counted, so the mutex is alive while they acquire
+	for (TaskImpl* task : grantedMultiLocks)
+		task->multiLock_->_acquire(KEY, *task, this);
+}
+
+void Mutex::_delete()
+{
+	std::function<void()> onRetired = std::move(onRetired_);
+	delete this;
+
+	if (onRetired)
+		onRetired();
+}
+
+void Mutex::_admit(TaskImpl& task)
+{
+	if (TaskImpl* parent = task.parent())
+		parent->addChildTask(task);
+	else
+		service_._addToQueue(KEY, task);
 }
 
 void Mutex::_queueTask(TaskImpl& task)
@@ -103,34 +296,92 @@ void Mutex::_queueTask(TaskImpl& task)
 	}
 }
 
-bool Mutex::_checkIfTaskCanBeStartedFromQueueAndStart()
+void Mutex::_startQueuedTasks()
 {
-	if (firstQueuedChild_)
+	switch (policy_)
+	{
+	case MutexPolicy::Fifo:
+		while (firstQueuedChild_ && _startQueuedTask(nullptr, *firstQueuedChild_)) {}
+		break;
+
+	case MutexPolicy::PreferWriters:
 	{
-		TaskImpl* task = firstQueuedChild_;
+		TaskImpl* prev = nullptr;
 
-		if (numTasksToBeFinished_ == 0 || (task->shared_ && sharedTasksInProgress_))
+		for (TaskImpl* task = firstQueuedChild_; task; prev = task, task = task->next_)
 		{
-			firstQueuedChild_ = task->next_;
+			if (!task->shared_)
+			{
+				_startQueuedTask(prev, *task);
+				return;
+			}
+		}
 
-			if (!firstQueuedChild_)
-				lastQueuedChild_ = nullptr;
+		_startQueuedSharedTasks();
+		break;
+	}
 
-			sharedTasksInProgress_ = task->shared_;
+	case MutexPolicy::BatchReaders:
+		if (firstQueuedChild_ && !firstQueuedChild_->shared_)
+			_startQueuedTask(nullptr, *firstQueuedChild_);
+		else
+			_startQueuedSharedTasks();
+		break;
+	}
+}
 
-			++numTasksToBeFinished_;
+void Mutex::_startQueuedSharedTasks()
+{
+	TaskImpl* prev = nullptr;
 
-			if (TaskImpl* parent = task->parent())
-				parent->addDeferredTask(*task);
-			else
-				service_._addToQueue(KEY, *task);
+	for (TaskImpl* task = firstQueuedChild_; task;)
+	{
+		// cache next task, because started task can be finished and deleted
+		TaskImpl* next = task->next_;
 
-			return true;
-		}
-	}
+		if (!task->shared_)
+			prev = task;
+		else if (!_startQueuedTask(prev, *task))
+			return;
 
-	return false;
+		task = next;
+	}
 }
 
+bool Mutex::_startQueuedTask(TaskImpl* prev, TaskImpl& task)
+{
+	const bool shared = task.shared_;
+	uint state = state_.load(std::memory_order_acquire);
+
+	do
+	{
+		if (!_canAcquire(state, shared))
+			return false;
+	}
+	while (!state_.compare_exchange_weak(state, state + (shared ? SharedOne : ExclusiveBit),
+		std::memory_order_acquire));
+
+	if (prev)
+		prev->next_ = task.next_;
+	else
+		firstQueuedChild_ = task.next_;
+
+	if (lastQueuedChild_ == &task)
+		lastQueuedChild_ = prev;
+
+	task.next_ = nullptr;
+
+	if (!firstQueuedChild_)
+		state_.fetch_and(~uint(WaitersBit), std::memory_order_acq_rel);
+
+	if (task.multiLock_)
+		grantedMultiLocks_.push_back(&task);
+	else if (TaskImpl* parent = task.parent())
+		parent->addDeferredTask(task);
+	else
+		service_._addToQueue(KEY, task);
+
+	return true;
 }
 
+}
@@ -0,0 +1,160 @@
+#include "asynctree_pipeline.h"
+#include "asynctree_service.h"
+
+#include <cassert>
+
+namespace ast
+{
+
+const uint PipelineBase::inputStage;
+
+PipelineBase::PipelineBase(Service& service, uint numTokens, EnumTaskWeight inputWeight)
+	: service_(service)
+	, inputWeight_(inputWeight)
+	, sequences_(numTokens)
+{
+	assert(numTokens > 0);
+
+	for (uint token = numTokens; token-- > 0;)
+		freeTokens_.push_back(token);
+}
+
+Task& PipelineBase::_run(EnumTaskWeight weight)
+{
+	auto self = shared_from_this();
+	return service_.task(weight, [self]() { self->_start(); });
+}
+
+void PipelineBase::_addStage(StageMode mode, EnumTaskWeight weight)
+{
+	assert(!task_);
+	stages_.emplace_back(mode, weight);
+}
+
+void PipelineBase::_start()
+{
+	assert(!task_);
+	task_ = &Service::currentTask()->_impl(KEY);
+
+	Launches launches;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	_scheduleInput(launches);
+	lock.unlock();
+
+	_launch(launches);
+}
+
+void PipelineBase::_execInTask(uint stage, uint token)
+{
+	const bool isInput = stage == inputStage;
+	bool hasItem = true;
+
+	if (isInput)
+		hasItem = _readInput(token);
+	else
+		_execStage(stage, token);
+
+	Launches launches;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	if (isInput)
+	{
+		inputBusy_ = false;
+
+		if (hasItem && !stages_.empty())
+		{
+			sequences_[token] = nextSequence_++;
+			_enterStage(0, token, launches);
+		}
+		else
+		{
+			inputDone_ = !hasItem;
+			freeTokens_.push_back(token);
+		}
+	}
+	else
+	{
+		Stage& current = stages_[stage];
+
+		if (current.mode_ != StageMode::Parallel)
+		{
+			current.busy_ = false;
+			++current.nextSequence_;
+			_dispatchSerial(stage, launches);
+		}
+
+		if (stage + 1 < stages_.size())
+			_enterStage(stage + 1, token, launches);
+		else
+			freeTokens_.push_back(token);
+	}
+
+	_scheduleInput(launches);
+	lock.unlock();
+
+	_launch(launches);
+}
+
+void PipelineBase::_scheduleInput(Launches& launches)
+{
+	// nothing more is read after a stage failed or the run task was interrupted
+	if (inputBusy_ || inputDone_ || freeTokens_.empty() || task_->isInterrupted())
+		return;
+
+	inputBusy_ = true;
+	launches.emplace_back(inputStage, freeTokens_.back());
+	freeTokens_.pop_back();
+}
+
+void PipelineBase::_enterStage(uint stage, uint token, Launches& launches)
+{
+	Stage& next = stages_[stage];
+
+	if (next.mode_ == StageMode::Parallel)
+	{
+		launches.emplace_back(stage, token);
+		return;
+	}
+
+	next.waiting_.emplace(sequences_[token], token);
+	_dispatchSerial(stage, launches);
+}
+
+void PipelineBase::_dispatchSerial(uint stage, Launches& launches)
+{
+	Stage& current = stages_[stage];
+
+	if (current.busy_ || current.waiting_.empty())
+		return;
+
+	auto first = current.waiting_.begin();
+
+	if (current.mode_ == StageMode::SerialInOrder && first->first != current.nextSequence_)
+		return;
+
+	current.busy_ = true;
+	launches.emplace_back(stage, first->second);
+	current.waiting_.erase(first);
+}
+
+void PipelineBase::_launch(const Launches& launches)
+{
+	if (launches.empty())
+		return;
+
+	auto self = shared_from_this();
+
+	for (auto& launch : launches)
+	{
+		const uint stage = launch.first;
+		const uint token = launch.second;
+		const EnumTaskWeight weight = stage == inputStage ? inputWeight_ : stages_[stage].weight_;
+
+		auto workFunc = [self, stage, token]() { self->_execInTask(stage, token); };
+		TaskTyped<decltype(workFunc)>::_create(KEY, service_, task_, weight, std::move(workFunc))->propagateFailure().start();
+	}
+}
+
+}
@@ -0,0 +1,107 @@
+#include "asynctree_semaphore.h"
+#include "asynctree_task.h"
+#include "asynctree_service.h"
+
+#include <cassert>
+
+namespace ast
+{
+
+Semaphore::Semaphore(Service& service, uint numPermits)
+: service_(service)
+, numPermits_(numPermits)
+, firstQueuedChild_(nullptr)
+, lastQueuedChild_(nullptr)
+, numTasksToBeFinished_(0)
+{
+	assert(numPermits > 0);
+}
+
+Semaphore::~Semaphore()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (numTasksToBeFinished_)
+	{
+		destroyCV_.wait(lock);
+	}
+}
+
+void Semaphore::_startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	auto* parentImpl = taskImpl.parent();
+
+	if (numTasksToBeFinished_ < numPermits_ && !firstQueuedChild_)
+	{
+		++numTasksToBeFinished_;
+		lock.unlock();
+
+		if (parentImpl)
+			parentImpl->addChildTask(taskImpl);
+		else
+			service_._addToQueue(KEY, taskImpl);
+	}
+	else
+	{
+		// parent waits for the queued task as for a deferred one
+		if (parentImpl)
+			parentImpl->notifyDeferredTask();
+
+		_queueTask(taskImpl);
+	}
+}
+
+void Semaphore::_taskFinished(AccessKey<TaskImpl>)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	--numTasksToBeFinished_;
+
+	while (_checkIfTaskCanBeStartedFromQueueAndStart()) {}
+
+	// notified under the lock, a blocked destructor may free the semaphore right after it
+	destroyCV_.notify_one();
+}
+
+void Semaphore::_queueTask(TaskImpl& task)
+{
+	task.next_ = nullptr;
+
+	if (lastQueuedChild_)
+	{
+		assert(firstQueuedChild_);
+		lastQueuedChild_->next_ = &task;
+		lastQueuedChild_ = &task;
+	}
+	else
+	{
+		assert(!firstQueuedChild_);
+		lastQueuedChild_ = firstQueuedChild_ = &task;
+	}
+}
+
+bool Semaphore::_checkIfTaskCanBeStartedFromQueueAndStart()
+{
+	if (!firstQueuedChild_ || numTasksToBeFinished_ >= numPermits_)
+		return false;
+
+	TaskImpl* task = firstQueuedChild_;
+	firstQueuedChild_ = task->next_;
+	task->next_ = nullptr;
+
+	if (!firstQueuedChild_)
+		lastQueuedChild_ = nullptr;
+
+	++numTasksToBeFinished_;
+
+	if (TaskImpl* parent = task->parent())
+		parent->addDeferredTask(*task);
+	else
+		service_._addToQueue(KEY, *task);
+
+	return true;
+}
+
+}
@@ -1,6 +1,7 @@
 #include "asynctree_service.h"
 #include "asynctree_task.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 
@@ -75,12 +76,16 @@ void Service::_startTask(AccessKey<TaskImpl>, TaskImpl& taskImpl)
 	}
 }
 
-void Service::_addToQueue(AccessKey<Service, Mutex, TaskImpl>, TaskImpl& task)
+void Service::_addToQueue(AccessKey<Service, Mutex, TaskImpl, ChannelBase, Semaphore, MultiLock, Event>, TaskImpl& task)
 {
 	auto& queue = queues_[task.weight()];
 
+	numPendingTasks_.fetch_add(1, std::memory_order_relaxed);
+
 	std::unique_lock<std::mutex> lock(mutex_);
 
+	task.prev_ = queue.lastInQueue_;
+
 	if (queue.lastInQueue_)
 	{
 		assert(queue.firstInQueue_ != nullptr);
@@ -95,6 +100,8 @@ void Service::_addToQueue(AccessKey<Service, Mutex, TaskImpl>, TaskImpl& task)
 		queue.firstInQueue_ = queue.lastInQueue_ = &task;
 	}
 
+	_linkToTree(task);
+
 	uint numToNotify = _syncWorkersQueue();
 
 	lock.unlock();
@@ -103,16 +110,96 @@ void Service::_addToQueue(AccessKey<Service, Mutex, TaskImpl>, TaskImpl& task)
 		workersCV_.notify_one();
 }
 
-void Service::_setCurrentTask(AccessKey<TaskImpl>, TaskImpl* task)
+void Service::_setCurrentTask(AccessKey<TaskImpl, CoScheduler>, TaskImpl* task)
 {
 	currentTask_ = task;
 }
 
+void Service::_purgeInterrupted(AccessKey<TaskImpl>, CancellationToken& token)
+{
+	std::vector<TaskImpl*> waiters;
+
+	std::unique_lock<std::mutex> lock(waitQueuesMutex_);
+
+	for (WaitQueue* queue : waitQueues_)
+		queue->_takeInterrupted(KEY, token, waiters);
+
+	lock.unlock();
+
+	// waiters are queued as started ones, so they're purged from the queues below
+	for (TaskImpl* task : waiters)
+	{
+		if (TaskImpl* parent = task->parent())
+			parent->addDeferredTask(*task);
+		else
+			_addToQueue(KEY, *task);
+	}
+
+	TaskImpl* firstPurged = nullptr;
+
+	lock = std::unique_lock<std::mutex>(mutex_);
+
+	// tasks of the tree queued in other services aren't tracked here, they're finished
+	// as interrupted once executed
+	for (TaskImpl* task = &token.service_ == this ? token.firstQueued_ : nullptr; task;)
+	{
+		TaskImpl* next = task->nextInTree_;
+
+		if (task->isInterrupted())
+		{
+			_unlinkFromTree(*task);
+			_unlinkFromQueue(*task);
+
+			// the tree list is newest first, so prepending restores the queue order
+			task->next_ = firstPurged;
+			firstPurged = task;
+		}
+
+		task = next;
+	}
+
+	lock.unlock();
+
+	// finished here as a worker would do it, the current task is restored after callbacks
+	TaskImpl* currentTask = currentTask_;
+
+	for (TaskImpl* task = firstPurged; task;)
+	{
+		TaskImpl* next = task->next_;
+		task->next_ = nullptr;
+
+		task->exec();
+		// !task is deleted further
+
+		numPendingTasks_.fetch_sub(1, std::memory_order_relaxed);
+		task = next;
+	}
+
+	currentTask_ = currentTask;
+}
+
+void Service::_addWaitQueue(AccessKey<Event, ChannelBase>, WaitQueue& queue)
+{
+	std::lock_guard<std::mutex> lock(waitQueuesMutex_);
+	waitQueues_.push_back(&queue);
+}
+
+void Service::_removeWaitQueue(AccessKey<Event, ChannelBase>, WaitQueue& queue)
+{
+	std::lock_guard<std::mutex> lock(waitQueuesMutex_);
+	waitQueues_.erase(std::find(waitQueues_.begin(), waitQueues_.end(), &queue));
+}
+
 Task* Service::currentTask()
 {
 	return currentTask_ ? &currentTask_->task() : nullptr;
 }
 
+bool Service::hasIdleWorkers() const
+{
+	return numPendingTasks_.load(std::memory_order_relaxed) < numThreads_;
+}
+
 void Service::waitUtilEverythingIsDone()
 {
 	std::unique_lock<std::mutex> lock(mutex_);
@@ -234,11 +321,18 @@ void Service::_moveTaskToWorkers(EnumTaskWeight weight)
 
 	queue.firstInQueue_ = task->next_;
 
-	if (!queue.firstInQueue_)
+	if (queue.firstInQueue_)
+	{
+		queue.firstInQueue_->prev_ = nullptr;
+	}
+	else
 	{
 		queue.lastInQueue_ = nullptr;
 	}
 
+	task->prev_ = nullptr;
+	_unlinkFromTree(*task);
+
 	++queue.numActiveWorkers_;
 
 	if (lastWorkerTask_)
@@ -260,6 +354,57 @@ void Service::_moveTaskToWorkers(EnumTaskWeight weight)
 	++numWorkingTasks_;
 }
 
+void Service::_unlinkFromQueue(TaskImpl& task)
+{
+	auto& queue = queues_[task.weight()];
+
+	if (task.prev_)
+		task.prev_->next_ = task.next_;
+	else
+		queue.firstInQueue_ = task.next_;
+
+	if (task.next_)
+		task.next_->prev_ = task.prev_;
+	else
+		queue.lastInQueue_ = task.prev_;
+
+	task.prev_ = task.next_ = nullptr;
+}
+
+void Service::_linkToTree(TaskImpl& task)
+{
+	CancellationToken& token = *task.cancellationToken();
+
+	if (&token.service_ != this)
+		return;
+
+	task.prevInTree_ = nullptr;
+	task.nextInTree_ = token.firstQueued_;
+
+	if (token.firstQueued_)
+		token.firstQueued_->prevInTree_ = &task;
+
+	token.firstQueued_ = &task;
+}
+
+void Service::_unlinkFromTree(TaskImpl& task)
+{
+	CancellationToken& token = *task.cancellationToken();
+
+	if (&token.service_ != this)
+		return;
+
+	if (task.prevInTree_)
+		task.prevInTree_->nextInTree_ = task.nextInTree_;
+	else
+		token.firstQueued_ = task.nextInTree_;
+
+	if (task.nextInTree_)
+		task.nextInTree_->prevInTree_ = task.prevInTree_;
+
+	task.prevInTree_ = task.nextInTree_ = nullptr;
+}
+
 void Service::_workerFunc()
 {
 	std::unique_lock<std::mutex> lock(mutex_);
@@ -302,6 +447,8 @@ void Service::_workerFunc()
 			task->exec();
 			// !task is deleted further
 
+			numPendingTasks_.fetch_sub(1, std::memory_order_relaxed);
+
 			lock.lock();
 
 			--numWorkingTasks_;
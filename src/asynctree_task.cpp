@@ -1,6 +1,9 @@
 #include "asynctree_task.h"
 #include "asynctree_service.h"
 #include "asynctree_mutex.h"
+#include "asynctree_semaphore.h"
+#include "asynctree_event.h"
+#include "asynctree_lock_all.h"
 
 #include <atomic>
 #include <algorithm>
@@ -16,19 +19,33 @@ namespace
 TaskImpl::TaskImpl(AccessKey<Task>, Task& task, Service& service, TaskImpl* parent, 
 	EnumTaskWeight weight)
 : next_(nullptr)
+, prev_(nullptr)
+, prevInTree_(nullptr)
+, nextInTree_(nullptr)
 , weight_(weight)
 , mutex_(nullptr)
+, semaphore_(nullptr)
+, event_(nullptr)
 , task_(task)
 , service_(service)
 , parent_(parent)
 , state_(State::Created)
-, interrupted_(false)
 , numChildrenToComplete_(0)
+, cancellationToken_(parent ? parent->cancellationToken_ : std::make_shared<CancellationToken>(service))
+, interrupted_(false)
+, settled_(false)
+, checkedGeneration_(cancellationToken_->generation_.load(std::memory_order_acquire))
+, arena_(parent ? parent->arena_ : nullptr)
+, continuation_(nullptr)
+, propagateFailure_(false)
 {
 }
 
 TaskImpl::~TaskImpl()
 {
+	// root task owns the arena of the tree
+	if (arena_ && !parent_)
+		arena_->release();
 }
 
 void TaskImpl::exec()
@@ -51,7 +68,14 @@ void TaskImpl::exec()
 
 	service_._setCurrentTask(KEY, this);
 
-	task_._execWorkFunc();
+	try
+	{
+		task_._execWorkFunc();
+	}
+	catch (...)
+	{
+		_fail(std::current_exception());
+	}
 
 	lock.lock();
 
@@ -65,9 +89,40 @@ void TaskImpl::exec()
 
 void TaskImpl::destroy()
 {
+	// continuation of a task that never finished, e.g. on service shutdown
+	if (continuation_)
+	{
+		continuation_->destroy();
+		continuation_ = nullptr;
+	}
+
 	task_.selfLock_.reset();
 }
 
+bool TaskImpl::setArena(std::size_t chunkSize, bool hugePages)
+{
+	assert(state_ == State::Created);
+
+	// only the root task owns an arena, it's released in its destructor
+	if (parent_ || arena_)
+		return false;
+
+	arena_ = new Arena(chunkSize, hugePages);
+	return true;
+}
+
+void TaskImpl::addContinuation(TaskImpl& continuation)
+{
+	assert(state_ == State::Created);
+	assert(continuation.parent_ == parent_);
+
+	TaskImpl* last = this;
+	while (last->continuation_)
+		last = last->continuation_;
+
+	last->continuation_ = &continuation;
+}
+
 void TaskImpl::addChildTask(TaskImpl& child)
 {
 	std::unique_lock<std::mutex> lock(taskMutex_);
@@ -89,41 +144,169 @@ void TaskImpl::addDeferredTask(TaskImpl& child)
 	_addChildTaskNoIncCounter(child, lock);
 }
 
+void TaskImpl::setJoin(JoinMode mode)
+{
+	assert(state_ == State::Created);
+	assert(!join_);
+
+	join_ = std::make_unique<JoinState>(mode);
+}
+
+void TaskImpl::addJoinInput(TaskImpl& input)
+{
+	assert(join_);
+
+	join_->numPending_.fetch_add(1, std::memory_order_relaxed);
+
+	std::unique_lock<std::mutex> lock(taskMutex_);
+	join_->inputs_.push_back(input.task_.weak_from_this());
+	const bool lost = join_->mode_ == JoinMode::Any && join_->resolved_.load(std::memory_order_acquire);
+	lock.unlock();
+
+	input._addSuccessor(*this);
+
+	if (lost)
+		input.interruptDownwards();
+}
+
+void TaskImpl::addPredecessor(TaskImpl& predecessor)
+{
+	assert(state_ == State::Created);
+
+	// dependencies are a join of all predecessors created on the first edge
+	if (!join_)
+		setJoin(JoinMode::All);
+
+	assert(join_->mode_ == JoinMode::All);
+
+	addJoinInput(predecessor);
+}
+
 void TaskImpl::start()
+{
+	// counted from here, so a retired mutex outlives tasks still waiting for their join
+	if (mutex_)
+		mutex_->_taskStarted(KEY);
+	else if (multiLock_)
+		multiLock_->_start(KEY);
+
+	if (join_)
+	{
+		// parent waits for the task as for a deferred one, until its inputs are resolved
+		if (parent_)
+			parent_->notifyDeferredTask();
+
+		_releaseJoinPending();
+		_releaseJoinLock();
+		return;
+	}
+
+	_startUnjoined();
+}
+
+void TaskImpl::_startUnjoined()
 {
 	if (mutex_) {
 		mutex_->_startTask(KEY, *this);
 	}
+	else if (semaphore_)
+	{
+		semaphore_->_startTask(KEY, *this);
+	}
+	else if (event_)
+	{
+		event_->_startTask(KEY, *this);
+	}
+	else if (multiLock_)
+	{
+		// parent waits for the task as for a deferred one, until all mutexes are acquired
+		if (parent_)
+			parent_->notifyDeferredTask();
+
+		multiLock_->_acquire(KEY, *this, nullptr);
+	}
 	else
 	{
 		service_._startTask(KEY, *this);
 	}
 }
 
+void TaskImpl::_fail(std::exception_ptr exception)
+{
+	{
+		std::lock_guard<std::mutex> lock(taskMutex_);
+
+		// the first failure wins, later ones are already covered by the interruption
+		if (exception_)
+			return;
+
+		exception_ = std::move(exception);
+	}
+
+	interruptDownwards();
+
+	if (propagateFailure_ && parent_)
+		parent_->_fail(exception_);
+	else
+		purgeInterrupted();
+}
+
 void TaskImpl::interruptDownwards()
 {
-	interrupted_ = true;
+	_interrupt();
+	cancellationToken_->generation_.fetch_add(1, std::memory_order_release);
 }
 
 void TaskImpl::interruptUpwards()
 {
-	interrupted_ = true;
+	for (TaskImpl* task = this; task; task = task->parent_)
+		task->_interrupt();
 
-	if (parent_)
-		parent_->interruptUpwards();
+	cancellationToken_->generation_.fetch_add(1, std::memory_order_release);
+}
+
+void TaskImpl::purgeInterrupted()
+{
+	service_._purgeInterrupted(KEY, *cancellationToken_);
 }
 
 bool TaskImpl::isInterrupted() const
 {
-	if (interrupted_)
+	if (interrupted_.load(std::memory_order_relaxed))
 		return true;
 
-	if (parent_ && parent_->isInterrupted())
+	const uint generation = cancellationToken_->generation_.load(std::memory_order_acquire);
+
+	// nothing was interrupted in the tree since the last check
+	if (generation == checkedGeneration_.load(std::memory_order_relaxed))
+		return false;
+
+	return _syncInterruption(generation);
+}
+
+void TaskImpl::_interrupt()
+{
+	// outcome of a finished task doesn't change
+	if (!settled_.load(std::memory_order_acquire))
+		interrupted_.store(true, std::memory_order_relaxed);
+}
+
+bool TaskImpl::_syncInterruption(uint generation) const
+{
+	// result of a finished task doesn't depend on its ancestors anymore
+	if (settled_.load(std::memory_order_acquire))
+		return interrupted_.load(std::memory_order_relaxed);
+
+	for (const TaskImpl* task = parent_; task; task = task->parent_)
 	{
-		interrupted_ = true;
-		return true;
+		if (task->interrupted_.load(std::memory_order_relaxed))
+		{
+			interrupted_.store(true, std::memory_order_relaxed);
+			return true;
+		}
 	}
 
+	checkedGeneration_.store(generation, std::memory_order_relaxed);
 	return false;
 }
 
@@ -161,6 +344,10 @@ void TaskImpl::_interruptWaitingTaskFromParent()
 	std::unique_lock<std::mutex> lock(taskMutex_);
 	assert(state_ == State::Created);
 
+	// settled before Done is published, successors added after that read the outcome
+	_interrupt();
+	settled_.store(true, std::memory_order_release);
+
 	state_ = State::Done;
 
 	service_._setCurrentTask(KEY, parent_);
@@ -170,6 +357,12 @@ void TaskImpl::_interruptWaitingTaskFromParent()
 	task_._execCallback(CallbackType::Interrupted);
 	task_._execCallback(CallbackType::Finished);
 
+	_releaseContinuation(true);
+	_notifySuccessors(true);
+
+	// the task was admitted by its mutex or semaphore before it was buffered in the parent
+	_releaseLocks();
+
 	destroy();
 }
 
@@ -177,21 +370,35 @@ void TaskImpl::_onFinished(std::unique_lock<std::mutex>& lock)
 {
 	assert(state_ != State::Done);
 
+	// settled before Done is published, successors added after that read the outcome
+	const bool interrupted = isInterrupted();
+	settled_.store(true, std::memory_order_release);
+
 	state_ = State::Done;
 
 	service_._setCurrentTask(KEY, parent_);
 
 	lock.unlock();
 
-	if (isInterrupted())
+	if (interrupted)
+	{
+		if (exception_)
+			task_._execCallback(CallbackType::Failed);
+
 		task_._execCallback(CallbackType::Interrupted);
+	}
 	else
+	{
 		task_._execCallback(CallbackType::Succeeded);
+	}
 
 	task_._execCallback(CallbackType::Finished);
 
-	if (mutex_)
-		mutex_->_taskFinished(KEY);
+	// continuation is started before the parent is notified, so the parent waits for it
+	_releaseContinuation(interrupted);
+	_notifySuccessors(interrupted);
+
+	_releaseLocks();
 
 	if (parent_)
 		parent_->_onChildFinished();
@@ -199,6 +406,141 @@ void TaskImpl::_onFinished(std::unique_lock<std::mutex>& lock)
 	destroy();
 }
 
+void TaskImpl::_releaseLocks()
+{
+	if (mutex_)
+		mutex_->_taskFinished(KEY, *this);
+
+	if (semaphore_)
+		semaphore_->_taskFinished(KEY);
+
+	if (multiLock_)
+		multiLock_->_release(KEY);
+}
+
+void TaskImpl::_releaseContinuation(bool interrupted)
+{
+	TaskImpl* continuation = continuation_;
+	if (!continuation)
+		return;
+
+	continuation_ = nullptr;
+
+	if (interrupted)
+	{
+		continuation->_interruptWaitingTaskFromParent();
+	}
+	else
+	{
+		continuation->propagateFailure_ = continuation->propagateFailure_ || propagateFailure_;
+		continuation->start();
+	}
+}
+
+void TaskImpl::_addSuccessor(TaskImpl& successor)
+{
+	std::unique_lock<std::mutex> lock(taskMutex_);
+
+	if (state_ == State::Done)
+	{
+		// settled before Done, so the outcome is final
+		const bool interrupted = interrupted_.load(std::memory_order_relaxed);
+		lock.unlock();
+
+		successor._onJoinInputFinished(interrupted);
+		return;
+	}
+
+	successors_.push_back(successor.task_.shared_from_this());
+}
+
+void TaskImpl::_notifySuccessors(bool interrupted)
+{
+	// no successors are added after the task is Done
+	for (auto& successor : successors_)
+		successor->impl_._onJoinInputFinished(interrupted);
+
+	successors_.clear();
+}
+
+void TaskImpl::_onJoinInputFinished(bool interrupted)
+{
+	// first interrupted input of JoinMode::All or first succeeded of JoinMode::Any decides
+	if (interrupted == (join_->mode_ == JoinMode::All))
+		_resolveJoin(interrupted);
+
+	_releaseJoinPending();
+}
+
+void TaskImpl::_releaseJoinPending()
+{
+	if (join_->numPending_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	// everything is finished: either all inputs of JoinMode::All have succeeded or
+	// none of JoinMode::Any has
+	_resolveJoin(join_->mode_ == JoinMode::Any);
+}
+
+void TaskImpl::_resolveJoin(bool interrupted)
+{
+	if (join_->resolved_.exchange(true, std::memory_order_acq_rel))
+		return;
+
+	join_->interrupted_.store(interrupted, std::memory_order_relaxed);
+
+	if (join_->mode_ == JoinMode::Any)
+	{
+		std::unique_lock<std::mutex> lock(taskMutex_);
+		std::vector<TaskW> inputs = std::move(join_->inputs_);
+		lock.unlock();
+
+		if (!interrupted)
+		{
+			for (auto& input : inputs)
+			{
+				if (TaskP inputP = input.lock())
+					inputP->interruptDownwards();
+			}
+		}
+	}
+
+	_releaseJoinLock();
+}
+
+void TaskImpl::_releaseJoinLock()
+{
+	if (join_->numLocks_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	if (join_->interrupted_.load(std::memory_order_relaxed))
+	{
+		_interrupt();
+
+		// finished without waiting for the event, there's nothing to release
+		event_ = nullptr;
+	}
+
+	if (mutex_ || semaphore_ || event_ || multiLock_)
+	{
+		// Acquired only now, as if the task was started now. Even an interrupted task takes
+		// its mutex or permit, because it releases them when finished. The parent stops
+		// waiting for the join after the task is counted again by the acquisition.
+		TaskImpl* parent = parent_;
+		_startUnjoined();
+
+		if (parent)
+			parent->_onChildFinished();
+
+		return;
+	}
+
+	if (parent_)
+		parent_->addDeferredTask(*this);
+	else
+		service_._addToQueue(KEY, *this);
+}
+
 void TaskImpl::_onChildExec(EnumTaskWeight weight)
 {
 	std::unique_lock<std::mutex> lock(taskMutex_);
@@ -276,25 +618,47 @@ Task::~Task()
 	assert(!selfLock_);
 }
 
-TaskImpl& Task::_impl(AccessKey<Service, Mutex>)
+TaskImpl& Task::_impl(AccessKey<Service, Mutex, Task, When, PipelineBase, CoScheduler, ChannelBase, Semaphore, LockAll, Event>)
 {
 	return impl_;
 }
 
 TaskP Task::start()
 {
+	// task can be finished and released before start() returns
+	TaskP self = shared_from_this();
 	impl_.start();
-	return shared_from_this();
+	return self;
+}
+
+Task& Task::withArena(std::size_t chunkSize, bool hugePages)
+{
+	impl_.setArena(chunkSize, hugePages);
+	return *this;
+}
+
+Task& Task::after(Task& predecessor)
+{
+	impl_.addPredecessor(predecessor.impl_);
+	return *this;
+}
+
+Task& Task::propagateFailure()
+{
+	impl_.setPropagateFailure();
+	return *this;
 }
 
 void Task::interruptDownwards()
 {
 	impl_.interruptDownwards();
+	impl_.purgeInterrupted();
 }
 
 void Task::interruptUpwards()
 {
 	impl_.interruptUpwards();
+	impl_.purgeInterrupted();
 }
 
 bool Task::isInterrupted() const
@@ -309,7 +673,7 @@ void Task::setSelfLock(TaskP selfLock)
 
 void Task::_execCallback(CallbackType type)
 {
-	const auto callAndDiscard = [](std::unique_ptr<DynamicCallback>& cb)
+	const auto callAndDiscard = [](DynamicCallbackP& cb)
 	{
 		if (!cb) return;
 		cb->exec();
@@ -321,6 +685,7 @@ void Task::_execCallback(CallbackType type)
 	case CallbackType::Succeeded: callAndDiscard(succeededCb_); break;
 	case CallbackType::Interrupted: callAndDiscard(interruptedCb_); break;
 	case CallbackType::Finished: callAndDiscard(finishedCb_); break;
+	case CallbackType::Failed: callAndDiscard(failedCb_); break;
 	}
 }
 
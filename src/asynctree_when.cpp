@@ -0,0 +1,21 @@
+#include "asynctree_when.h"
+#include "asynctree_service.h"
+
+namespace ast
+{
+
+Task& When::_join(JoinMode mode, std::initializer_list<Task*> inputs)
+{
+	Service& service = (*inputs.begin())->_impl(KEY).service();
+
+	Task& join = service.task(Light, []() {});
+	auto& joinImpl = join._impl(KEY);
+	joinImpl.setJoin(mode);
+
+	for (Task* input : inputs)
+		joinImpl.addJoinInput(input->_impl(KEY));
+
+	return join;
+}
+
+}
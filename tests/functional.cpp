@@ -5,6 +5,11 @@
 #include <memory>
 #include <future>
 #include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <string>
+#include <stdexcept>
 
 class AsyncTreeFunctional : public ::testing::Test
 {
@@ -385,3 +390,1673 @@ TEST_F(AsyncTreeFunctional, Stress_10KTasksWithDynamicCallbacks)
 	EXPECT_EQ(numFinished.load(), 100000);
 }
 
+TEST_F(AsyncTreeFunctional, InterruptDownwardsReachesOnlyDescendants)
+{
+	std::promise<bool> leavesStarted;
+	auto leavesStartedFuture = leavesStarted.get_future().share();
+	std::promise<bool> onInterrupted;
+	auto onInterruptedFuture = onInterrupted.get_future().share();
+	std::atomic<int> numStarted(0);
+
+	std::atomic<ast::Task*> branch(nullptr);
+	bool isBranchLeafInterrupted = false;
+	bool isSiblingLeafInterrupted = true;
+
+	const auto waitingLeaf = [&](bool& isInterrupted) {
+		return [&]() {
+			if (numStarted.fetch_add(1) == 1)
+				leavesStarted.set_value(true);
+
+			onInterruptedFuture.wait();
+			isInterrupted = ast::Service::currentTask()->isInterrupted();
+		};
+	};
+
+	service_->task(ast::Light, [&]() {
+		service_->task(ast::Light, [&]() {
+			branch = ast::Service::currentTask();
+			service_->task(ast::Light, [&]() {
+				service_->task(ast::Light, waitingLeaf(isBranchLeafInterrupted)).start();
+			}).start();
+		}).start();
+
+		service_->task(ast::Light, [&]() {
+			service_->task(ast::Light, waitingLeaf(isSiblingLeafInterrupted)).start();
+		}).start();
+	}).start();
+
+	leavesStartedFuture.wait();
+	branch.load()->interruptDownwards();
+	onInterrupted.set_value(true);
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(isBranchLeafInterrupted, true);
+	EXPECT_EQ(isSiblingLeafInterrupted, false);
+}
+
+TEST_F(AsyncTreeFunctional, Stress_10KTasksInArena)
+{
+	std::atomic<int> counter(0);
+	std::atomic<int> numSucceeded(0);
+	int rootFinished = 0;
+
+	service_->topmostTask(ast::Light, [&] {
+		for (int a = 0; a < 100; ++a)
+		{
+			service_->task(ast::Light, [&] {
+				for (int b = 0; b < 100; ++b)
+				{
+					service_->task(ast::Light, [&] {
+						counter.fetch_add(1);
+					}
+					, ast::finished([&] {})
+					)
+					.succeeded([&] {
+						numSucceeded.fetch_add(1);
+					})
+					.start();
+				}
+			})
+			.start();
+		}
+	})
+	.withArena(64 * 1024)
+	.finished([&] { ++rootFinished; })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(counter.load(), 10000);
+	EXPECT_EQ(numSucceeded.load(), 10000);
+	EXPECT_EQ(rootFinished, 1);
+}
+
+TEST_F(AsyncTreeFunctional, ArenaOutlivesRootAndIgnoresChildArena)
+{
+	ast::TaskP child;
+	int numSucceeded = 0;
+
+	service_->topmostTask(ast::Light, [&] {
+		child = service_->task(ast::Light, [] {})
+		.withArena(1024)
+		.succeeded([&] { ++numSucceeded; })
+		.start();
+	})
+	.withArena(1024)
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numSucceeded, 1);
+
+	// the child was allocated in the arena of the root, which is already destroyed
+	child.reset();
+}
+
+TEST_F(AsyncTreeFunctional, ManyStaticCallbacks)
+{
+	std::vector<int> sequence;
+
+	service_->task(ast::Light, [&]() {}
+	, ast::succeeded([&]() { sequence.push_back(0); })
+	, ast::finished([&]() { sequence.push_back(3); })
+	, ast::interrupted([&]() { sequence.push_back(-1); })
+	, ast::succeeded([&]() { sequence.push_back(1); })
+	, ast::finished([&]() { sequence.push_back(4); })
+	, ast::succeeded([&]() { sequence.push_back(2); })
+	).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(sequence, std::vector<int>({ 0, 1, 2, 3, 4 }));
+}
+
+TEST_F(AsyncTreeFunctional, ResultIsPassedToCallbacks)
+{
+	int staticResult = 0;
+	std::unique_ptr<int> movedResult;
+	std::string dynamicResult;
+
+	auto task = service_->task(ast::Light, []() { return 42; }
+	, ast::succeeded([&](const int& result) { staticResult = result; })
+	).start();
+
+	service_->task(ast::Light, []() { return std::make_unique<int>(7); })
+	.succeeded([&](std::unique_ptr<int>&& result) { movedResult = std::move(result); })
+	.start();
+
+	service_->task<std::string>(ast::Light, []() { return "text"; })
+	.succeeded([&](std::string& result) { dynamicResult = result; })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(staticResult, 42);
+	EXPECT_EQ(task->result(), 42);
+	ASSERT_TRUE(movedResult);
+	EXPECT_EQ(*movedResult, 7);
+	EXPECT_EQ(dynamicResult, "text");
+}
+
+TEST_F(AsyncTreeFunctional, ParentCollectsChildResults)
+{
+	int sum = 0;
+
+	service_->task(ast::Light, [&]() {
+		std::vector<std::shared_ptr<ast::ResultTask<int>>> children;
+
+		for (int i = 1; i <= 10; ++i)
+			children.push_back(service_->task(ast::Light, [i]() { return i * i; }).start());
+
+		return children;
+	}
+	, ast::succeeded([&](std::vector<std::shared_ptr<ast::ResultTask<int>>>& children) {
+		for (auto& child : children)
+			sum += child->result();
+	})
+	).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(sum, 385);
+}
+
+TEST_F(AsyncTreeFunctional, ThenRunsChainInOrder)
+{
+	std::vector<int> sequence;
+	int parentSucceeded = 0;
+
+	service_->task(ast::Light, [&]() {
+		service_->task(ast::Light, [&]() { sequence.push_back(0); })
+		.then(ast::Middle, [&]() { sequence.push_back(1); })
+		.then(ast::Heavy, [&]() { sequence.push_back(2); }
+		, ast::succeeded([&]() { sequence.push_back(3); })
+		).start();
+	}
+	, ast::succeeded([&]() { ++parentSucceeded; EXPECT_EQ(sequence.size(), 4u); })
+	).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(sequence, std::vector<int>({ 0, 1, 2, 3 }));
+	EXPECT_EQ(parentSucceeded, 1);
+}
+
+TEST_F(AsyncTreeFunctional, ThenIsSkippedOnInterrupt)
+{
+	int numCalls = 0;
+	int continuationInterrupted = 0;
+	int continuationFinished = 0;
+
+	service_->task(ast::Light, [&]() {
+		ast::Service::currentTask()->interruptDownwards();
+	})
+	.then(ast::Light, [&]() { ++numCalls; }
+	, ast::interrupted([&]() { ++continuationInterrupted; })
+	, ast::finished([&]() { ++continuationFinished; })
+	).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numCalls, 0);
+	EXPECT_EQ(continuationInterrupted, 1);
+	EXPECT_EQ(continuationFinished, 1);
+}
+
+TEST_F(AsyncTreeFunctional, WhenAllJoinsTasksOfDifferentTrees)
+{
+	std::atomic<int> counter(0);
+	int joinSucceeded = 0;
+	int counterInJoin = 0;
+
+	auto& first = service_->topmostTask(ast::Light, [&]() {
+		for (int i = 0; i < 10; ++i)
+			service_->task(ast::Light, [&]() { counter.fetch_add(1); }).start();
+	});
+
+	auto& second = service_->topmostTask(ast::Heavy, [&]() { counter.fetch_add(1); });
+
+	ast::whenAll(first, second)
+	.succeeded([&]() {
+		++joinSucceeded;
+		counterInJoin = counter.load();
+	})
+	.start();
+
+	first.start();
+	second.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(joinSucceeded, 1);
+	EXPECT_EQ(counterInJoin, 11);
+}
+
+TEST_F(AsyncTreeFunctional, WhenAllIsInterruptedByInput)
+{
+	int joinSucceeded = 0;
+	int joinInterrupted = 0;
+
+	auto& first = service_->task(ast::Light, []() {});
+	auto& second = service_->task(ast::Light, []() {
+		ast::Service::currentTask()->interruptDownwards();
+	});
+
+	ast::whenAll(first, second)
+	.succeeded([&]() { ++joinSucceeded; })
+	.interrupted([&]() { ++joinInterrupted; })
+	.start();
+
+	first.start();
+	second.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(joinSucceeded, 0);
+	EXPECT_EQ(joinInterrupted, 1);
+}
+
+TEST_F(AsyncTreeFunctional, WhenAnyInterruptsLosers)
+{
+	int joinSucceeded = 0;
+	bool isSlowInterrupted = false;
+
+	auto slow = service_->task(ast::Light, [&]() {
+		while (!ast::Service::currentTask()->isInterrupted())
+			std::this_thread::yield();
+	})
+	.interrupted([&]() { isSlowInterrupted = true; })
+	.start();
+
+	auto& fast = service_->task(ast::Light, []() {});
+
+	ast::whenAny(*slow, fast)
+	.succeeded([&]() { ++joinSucceeded; })
+	.start();
+
+	auto fastP = fast.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(joinSucceeded, 1);
+	EXPECT_EQ(slow->isInterrupted(), true);
+	EXPECT_TRUE(isSlowInterrupted);
+	EXPECT_EQ(fastP->isInterrupted(), false);
+}
+
+TEST_F(AsyncTreeFunctional, ParallelForVisitsEveryIndexOnce)
+{
+	std::vector<std::atomic<int>> visits(100000);
+
+	ast::parallelFor(*service_, ast::Light, ast::range(0, 100000), 100, [&](int first, int last) {
+		for (int i = first; i < last; ++i)
+			visits[i].fetch_add(1);
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int>& v) { return v == 1; }));
+}
+
+TEST_F(AsyncTreeFunctional, ParallelReduceKeepsOrder)
+{
+	typedef std::pair<int, int> Span;
+	bool ordered = true;
+	Span total(-1, -1);
+
+	auto task = ast::parallelReduce(*service_, ast::Light, ast::range(0, 100000), 10, Span(-1, -1)
+	, [](int first, int last, Span span) {
+		return span.first < 0 ? Span(first, last) : Span(span.first, last);
+	}
+	, [&](Span left, Span right) {
+		if (left.first < 0) return right;
+		if (right.first < 0) return left;
+		if (left.second != right.first) ordered = false;
+		return Span(left.first, right.second);
+	})
+	.succeeded([&](Span span) { total = span; })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(ordered);
+	EXPECT_EQ(total, Span(0, 100000));
+}
+
+TEST_F(AsyncTreeFunctional, ParallelScanMatchesSerialScan)
+{
+	std::vector<int> input(100003);
+	for (size_t i = 0; i < input.size(); ++i)
+		input[i] = int(i % 17) - 8;
+
+	std::vector<int> expectedInclusive(input.size());
+	std::inclusive_scan(input.begin(), input.end(), expectedInclusive.begin(), std::plus<>(), 5);
+	std::vector<int> expectedExclusive(input.size());
+	std::exclusive_scan(input.begin(), input.end(), expectedExclusive.begin(), 5);
+
+	std::vector<int> inclusive(input.size());
+	ast::parallelScan(*service_, ast::Light, input.begin(), input.end(), inclusive.begin(), 5,
+		std::plus<>(), ast::ScanType::Inclusive, 1000).start();
+
+	std::vector<int> exclusive = input;
+	ast::parallelScan(*service_, ast::Light, exclusive.begin(), exclusive.end(), exclusive.begin(), 5,
+		std::plus<>(), ast::ScanType::Exclusive, 1000).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(inclusive, expectedInclusive);
+	EXPECT_EQ(exclusive, expectedExclusive);
+}
+
+TEST_F(AsyncTreeFunctional, ParallelScanKeepsOrderOfNonCommutativeOp)
+{
+	// composition of affine maps x -> a * x + b is associative but not commutative
+	typedef std::pair<long long, long long> Affine;
+	const auto compose = [](const Affine& f, const Affine& g) {
+		return Affine(f.first * g.first % 1000003, (f.second * g.first + g.second) % 1000003);
+	};
+
+	std::vector<Affine> input(5000);
+	for (size_t i = 0; i < input.size(); ++i)
+		input[i] = Affine(i % 7 + 1, i % 11);
+
+	std::vector<Affine> expected(input.size());
+	std::inclusive_scan(input.begin(), input.end(), expected.begin(), compose, Affine(1, 0));
+
+	std::vector<Affine> result(input.size());
+	ast::parallelScan(*service_, ast::Light, input.begin(), input.end(), result.begin(), Affine(1, 0),
+		compose, ast::ScanType::Inclusive, 64).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(result, expected);
+}
+
+TEST_F(AsyncTreeFunctional, ParallelSortMatchesStdSort)
+{
+	std::vector<int> integers(200000);
+	std::vector<double> reals(200000);
+
+	for (size_t i = 0; i < integers.size(); ++i)
+	{
+		integers[i] = int((i * 2654435761u) % 100000) - 50000;
+		reals[i] = double((i * 40503u) % 65536) * 0.5;
+	}
+
+	std::vector<int> expectedIntegers = integers;
+	std::sort(expectedIntegers.begin(), expectedIntegers.end());
+	std::vector<double> expectedReals = reals;
+	std::sort(expectedReals.begin(), expectedReals.end(), std::greater<>());
+
+	ast::parallelSort(*service_, ast::Light, integers.begin(), integers.end()).start();
+	ast::parallelSort(*service_, ast::Light, reals.begin(), reals.end(), std::greater<>(), 1000).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(integers, expectedIntegers);
+	EXPECT_EQ(reals, expectedReals);
+}
+
+static std::string exceptionMessage(std::exception_ptr exception)
+{
+	try
+	{
+		std::rethrow_exception(exception);
+	}
+	catch (const std::exception& e)
+	{
+		return e.what();
+	}
+}
+
+TEST_F(AsyncTreeFunctional, ParallelForFailsWithBodyException)
+{
+	std::string failure;
+	bool isSucceeded = false;
+
+	ast::parallelFor(*service_, ast::Light, ast::range(0, 100000), 100, [](int first, int last) {
+		if (first <= 50000 && 50000 < last)
+			throw std::runtime_error("body");
+	})
+	.succeeded([&]() { isSucceeded = true; })
+	.failed([&](std::exception_ptr exception) { failure = exceptionMessage(exception); })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(isSucceeded);
+	EXPECT_EQ(failure, "body");
+}
+
+TEST_F(AsyncTreeFunctional, ParallelReduceFailsWithReduceException)
+{
+	std::string failure;
+	bool isSucceeded = false;
+
+	ast::parallelReduce(*service_, ast::Light, ast::range(0, 100000), 10, 0
+	, [](int first, int last, int sum) {
+		if (first <= 50000 && 50000 < last)
+			throw std::runtime_error("reduce");
+		return sum + (last - first);
+	}
+	, [](int left, int right) { return left + right; })
+	.succeeded([&]() { isSucceeded = true; })
+	.failed([&](std::exception_ptr exception) { failure = exceptionMessage(exception); })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(isSucceeded);
+	EXPECT_EQ(failure, "reduce");
+}
+
+TEST_F(AsyncTreeFunctional, ParallelScanFailsWithOpException)
+{
+	std::vector<int> input(100000, 1);
+	input[50000] = -1;
+
+	std::string failure;
+	bool isSucceeded = false;
+
+	std::vector<int> result(input.size());
+	ast::parallelScan(*service_, ast::Light, input.begin(), input.end(), result.begin(), 0, [](int sum, int value) {
+		if (value < 0)
+			throw std::runtime_error("op");
+		return sum + value;
+	}, ast::ScanType::Inclusive, 1000)
+	.succeeded([&]() { isSucceeded = true; })
+	.failed([&](std::exception_ptr exception) { failure = exceptionMessage(exception); })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(isSucceeded);
+	EXPECT_EQ(failure, "op");
+}
+
+TEST_F(AsyncTreeFunctional, ParallelSortFailsWithCompareException)
+{
+	std::vector<double> reals(200000);
+	for (size_t i = 0; i < reals.size(); ++i)
+		reals[i] = double((i * 40503u) % 65536);
+	reals[150000] = -1.0;
+
+	std::string failure;
+	bool isSucceeded = false;
+
+	ast::parallelSort(*service_, ast::Light, reals.begin(), reals.end(), [](double left, double right) {
+		if (left < 0.0 || right < 0.0)
+			throw std::runtime_error("compare");
+		return left < right;
+	}, 1000)
+	.succeeded([&]() { isSucceeded = true; })
+	.failed([&](std::exception_ptr exception) { failure = exceptionMessage(exception); })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(isSucceeded);
+	EXPECT_EQ(failure, "compare");
+}
+
+TEST_F(AsyncTreeFunctional, AfterRunsDiamondInOrder)
+{
+	std::vector<char> order;
+	std::mutex orderMutex;
+
+	auto log = [&](char name) {
+		std::lock_guard<std::mutex> lock(orderMutex);
+		order.push_back(name);
+	};
+
+	service_->task(ast::Light, [&]() {
+		auto& a = service_->task(ast::Heavy, [&]() { log('a'); });
+		auto& b = service_->task(ast::Light, [&]() { log('b'); });
+		auto& c = service_->task(ast::Middle, [&]() { log('c'); });
+		auto& d = service_->task(ast::Light, [&]() { log('d'); });
+
+		d.after(b).after(c).start();
+		b.after(a).start();
+		c.after(a).start();
+		a.start();
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	ASSERT_EQ(order.size(), 4u);
+	EXPECT_EQ(order.front(), 'a');
+	EXPECT_EQ(order.back(), 'd');
+}
+
+TEST_F(AsyncTreeFunctional, AfterIsInterruptedByPredecessor)
+{
+	int numCalls = 0;
+	int numInterrupted = 0;
+
+	service_->task(ast::Light, [&]() {
+		auto& a = service_->task(ast::Light, []() {
+			ast::Service::currentTask()->interruptDownwards();
+		});
+		auto& b = service_->task(ast::Light, [&]() { ++numCalls; });
+		auto& c = service_->task(ast::Light, [&]() { ++numCalls; });
+
+		b.after(a).interrupted([&]() { ++numInterrupted; }).start();
+		c.after(b).interrupted([&]() { ++numInterrupted; }).start();
+		a.start();
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numCalls, 0);
+	EXPECT_EQ(numInterrupted, 2);
+}
+
+TEST_F(AsyncTreeFunctional, AfterAcquiresMutexWhenPredecessorsResolve)
+{
+	ast::Mutex mutex(*service_);
+	std::atomic<int> numInside(0);
+	std::atomic<bool> overlapped(false);
+	int numCalls = 0;
+	int numInterrupted = 0;
+
+	auto exclusive = [&]() {
+		if (numInside.fetch_add(1) != 0)
+			overlapped = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		++numCalls;
+		numInside.fetch_sub(1);
+	};
+
+	service_->task(ast::Light, [&]() {
+		auto& a = service_->task(ast::Light, []() {});
+		auto& b = service_->task(ast::Light, []() {
+			ast::Service::currentTask()->interruptDownwards();
+		});
+
+		for (int i = 0; i < 4; ++i)
+			mutex.task(ast::Light, exclusive).after(a).start();
+
+		mutex.task(ast::Light, exclusive).after(b).interrupted([&]() { ++numInterrupted; }).start();
+		a.start();
+		b.start();
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(overlapped);
+	EXPECT_EQ(numCalls, 4);
+	EXPECT_EQ(numInterrupted, 1);
+
+	// the lock is balanced, so the mutex is still exclusive
+	for (int i = 0; i < 4; ++i)
+		mutex.task(ast::Light, exclusive).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(overlapped);
+	EXPECT_EQ(numCalls, 8);
+}
+
+TEST_F(AsyncTreeFunctional, PipelineKeepsOrderOfSerialStage)
+{
+	const int numItems = 1000;
+	const uint numTokens = 8;
+
+	std::atomic<int> inFlight(0);
+	std::atomic<int> maxInFlight(0);
+	std::vector<int> output;
+	int counter = 0;
+
+	ast::Pipeline<int> pipeline(*service_, numTokens, ast::Light, [&](int& item) {
+		if (counter == numItems)
+			return false;
+
+		item = counter++;
+
+		const int current = inFlight.fetch_add(1) + 1;
+		int max = maxInFlight.load();
+		while (current > max && !maxInFlight.compare_exchange_weak(max, current)) {}
+
+		return true;
+	});
+
+	pipeline
+	.stage(ast::StageMode::Parallel, ast::Middle, [](int& item) { item *= 2; })
+	.stage(ast::StageMode::SerialOutOfOrder, ast::Light, [](int& item) { item += 1; })
+	.stage(ast::StageMode::SerialInOrder, ast::Light, [&](int& item) {
+		output.push_back(item);
+		inFlight.fetch_sub(1);
+	});
+
+	pipeline.run().start();
+
+	service_->waitUtilEverythingIsDone();
+	ASSERT_EQ(output.size(), size_t(numItems));
+
+	for (int i = 0; i < numItems; ++i)
+		EXPECT_EQ(output[i], i * 2 + 1);
+
+	EXPECT_LE(maxInFlight.load(), int(numTokens));
+}
+
+TEST_F(AsyncTreeFunctional, PipelineFailsWithStageException)
+{
+	const int numItems = 100;
+	const uint numTokens = 4;
+
+	std::vector<int> output;
+	std::atomic<int> counter(0);
+	std::string failure;
+	bool isSucceeded = false;
+
+	ast::Pipeline<int> pipeline(*service_, numTokens, ast::Light, [&](int& item) {
+		if (counter == numItems)
+			return false;
+
+		item = counter++;
+		return true;
+	});
+
+	pipeline
+	.stage(ast::StageMode::Parallel, ast::Middle, [](int& item) {
+		if (item == 10)
+			throw std::runtime_error("stage");
+	})
+	.stage(ast::StageMode::SerialInOrder, ast::Light, [&](int& item) { output.push_back(item); });
+
+	pipeline.run()
+	.succeeded([&]() { isSucceeded = true; })
+	.failed([&](std::exception_ptr exception) { failure = exceptionMessage(exception); })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(isSucceeded);
+	EXPECT_EQ(failure, "stage");
+	EXPECT_LE(output.size(), 10u);
+
+	// input stops soon after the failure
+	EXPECT_LE(counter.load(), 11 + int(numTokens));
+}
+
+#if defined(__cpp_impl_coroutine)
+
+static ast::Co<int> addLater(ast::Service& service, int a, int b)
+{
+	const std::optional<int> sum = co_await service.task<int>(ast::Middle, [a, b]() { return a + b; });
+	co_return *sum;
+}
+
+TEST_F(AsyncTreeFunctional, CoroutineAwaitsTasks)
+{
+	int result = 0;
+	bool childSucceeded = false;
+
+	ast::coTask(*service_, ast::Light, [&]() -> ast::Co<int> {
+		childSucceeded = co_await service_->task(ast::Light, []() {});
+
+		int sum = 0;
+		for (int i = 0; i < 10; ++i)
+			sum = co_await addLater(*service_, sum, i);
+
+		co_return sum;
+	})
+	.succeeded([&](int value) { result = value; })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(childSucceeded, true);
+	EXPECT_EQ(result, 45);
+}
+
+TEST_F(AsyncTreeFunctional, CoroutineHoldsMutexAcrossSuspension)
+{
+	ast::Mutex mutex(*service_);
+	int counter = 0;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		ast::coTask(*service_, ast::Light, [&]() -> ast::Co<> {
+			auto lock = co_await mutex.lock();
+
+			const int value = counter;
+			co_await service_->task(ast::Light, []() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			});
+			counter = value + 1;
+		})
+		.start();
+	}
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(counter, 8);
+}
+
+TEST_F(AsyncTreeFunctional, CoroutineLocksMutexInLoop)
+{
+	ast::Mutex mutex(*service_);
+	int counter = 0;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		ast::coTask(*service_, ast::Light, [&]() -> ast::Co<> {
+			for (int j = 0; j < 8; ++j)
+			{
+				auto lock = co_await mutex.lock();
+
+				const int value = counter;
+				co_await service_->task(ast::Light, []() {});
+				counter = value + 1;
+			}
+		})
+		.start();
+	}
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(counter, 32);
+}
+
+TEST_F(AsyncTreeFunctional, CoroutineReleasesMutexAfterUnlock)
+{
+	ast::Mutex mutex(*service_);
+	int numContenders = 0;
+
+	// deadlocks if the awaited task is still in the subtree of the mutex task
+	auto contend = [&]() {
+		mutex.task(ast::Light, [&]() { ++numContenders; }).start();
+	};
+
+	ast::coTask(*service_, ast::Light, [&]() -> ast::Co<> {
+		auto lock = co_await mutex.lock();
+		lock.unlock();
+		co_await service_->task(ast::Light, contend);
+
+		{
+			auto scopedLock = co_await mutex.lock();
+		}
+
+		co_await service_->task(ast::Light, contend);
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numContenders, 2);
+}
+
+static ast::Co<> throwLater(ast::Service& service)
+{
+	co_await service.task(ast::Light, []() {});
+	throw std::runtime_error("inner");
+}
+
+TEST_F(AsyncTreeFunctional, CoroutineExceptionFailsTask)
+{
+	std::string caught;
+	std::string failure;
+
+	ast::coTask(*service_, ast::Light, [&]() -> ast::Co<> {
+		try
+		{
+			co_await throwLater(*service_);
+		}
+		catch (const std::runtime_error& exception)
+		{
+			caught = exception.what();
+		}
+
+		co_await service_->task(ast::Light, []() {});
+		throw std::runtime_error("outer");
+	})
+	.failed([&](std::exception_ptr exception) {
+		try
+		{
+			std::rethrow_exception(exception);
+		}
+		catch (const std::exception& e)
+		{
+			failure = e.what();
+		}
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(caught, "inner");
+	EXPECT_EQ(failure, "outer");
+}
+
+#endif
+
+TEST_F(AsyncTreeFunctional, ChannelPassesValuesInOrder)
+{
+	const int numValues = 1000;
+	ast::Channel<int> channel(*service_, 4);
+	std::vector<int> received;
+	std::atomic<size_t> maxSize(0);
+
+	std::function<void(int)> produce = [&](int value) {
+		if (value == numValues)
+			return;
+
+		channel.send(ast::Light, value, [&, value]() {
+			maxSize.store(std::max(maxSize.load(), channel.size()));
+			produce(value + 1);
+		});
+	};
+
+	std::function<void()> consume = [&]() {
+		channel.receive(ast::Light, [&](int& value) {
+			received.push_back(value);
+
+			if (received.size() < size_t(numValues))
+				consume();
+		});
+	};
+
+	service_->task(ast::Light, [&]() { consume(); }).start();
+	service_->task(ast::Light, [&]() { produce(0); }).start();
+
+	service_->waitUtilEverythingIsDone();
+	ASSERT_EQ(received.size(), size_t(numValues));
+
+	for (int i = 0; i < numValues; ++i)
+		EXPECT_EQ(received[i], i);
+
+	EXPECT_LE(maxSize.load(), size_t(4));
+}
+
+TEST_F(AsyncTreeFunctional, ChannelCloseReleasesWaiters)
+{
+	ast::Channel<int> channel(*service_, 1);
+	ast::Channel<int> emptyChannel(*service_, 1);
+	int numSent = 0;
+	std::vector<int> received;
+	int numClosed = 0;
+
+	auto receive = [&](ast::Channel<int>& from) {
+		from.receive(ast::Light, [&](int& value) { received.push_back(value); }, [&]() { ++numClosed; });
+	};
+
+	service_->task(ast::Light, [&]() {
+		receive(emptyChannel);
+
+		channel.send(ast::Light, 1, [&]() { ++numSent; });
+		channel.send(ast::Light, 2, [&]() { ++numSent; });
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numSent, 1);
+
+	// the waiting sender is interrupted, the buffered value is still received
+	service_->task(ast::Light, [&]() {
+		channel.close();
+		emptyChannel.close();
+		channel.send(ast::Light, 3, [&]() { ++numSent; });
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(channel.isClosed());
+	EXPECT_EQ(numSent, 1);
+	EXPECT_EQ(numClosed, 1);
+
+	receive(channel);
+	service_->waitUtilEverythingIsDone();
+	receive(channel);
+	service_->waitUtilEverythingIsDone();
+
+	EXPECT_EQ(received, std::vector<int>{ 1 });
+	EXPECT_EQ(numClosed, 2);
+}
+
+TEST_F(AsyncTreeFunctional, ChannelInterruptionKeepsValues)
+{
+	ast::Channel<int> channel(*service_, 4);
+	std::mutex receivedMutex;
+	std::vector<int> received;
+	bool isWaitingTreeFinished = false;
+
+	auto receive = [&]() {
+		channel.receive(ast::Light, [&](int& value) {
+			std::lock_guard<std::mutex> lock(receivedMutex);
+			received.push_back(value);
+		});
+	};
+
+	// the waiting receive is finished with its tree and doesn't take the next value
+	service_->task(ast::Light, [&]() {
+		receive();
+		ast::Service::currentTask()->interruptDownwards();
+	},
+	ast::finished([&]() { isWaitingTreeFinished = true; })).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isWaitingTreeFinished);
+
+	channel.send(ast::Light, 42, []() {});
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(channel.size(), 1u);
+
+	// the value taken by a receive of an interrupted tree returns to the channel
+	service_->task(ast::Light, [&]() {
+		receive();
+		ast::Service::currentTask()->interruptDownwards();
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	receive();
+	service_->waitUtilEverythingIsDone();
+	channel.close();
+	service_->waitUtilEverythingIsDone();
+
+	EXPECT_EQ(received, std::vector<int>{ 42 });
+}
+
+TEST_F(AsyncTreeFunctional, SemaphoreLimitsConcurrency)
+{
+	ast::Semaphore semaphore(*service_, 3);
+	std::atomic<int> numRunning(0);
+	std::atomic<int> maxRunning(0);
+	std::atomic<int> numFinished(0);
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < 32; ++i)
+		{
+			semaphore.task(ast::Light, [&]() {
+				const int running = numRunning.fetch_add(1) + 1;
+				int max = maxRunning.load();
+				while (running > max && !maxRunning.compare_exchange_weak(max, running)) {}
+
+				// permit is held until the children are finished
+				service_->task(ast::Middle, [&]() {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					numRunning.fetch_sub(1);
+				}).start();
+			})
+			.finished([&]() { numFinished.fetch_add(1); })
+			.start();
+		}
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numFinished.load(), 32);
+	EXPECT_LE(maxRunning.load(), 3);
+}
+
+TEST_F(AsyncTreeFunctional, MutexExcludesWritersFromReaders)
+{
+	ast::Mutex mutex(*service_);
+	std::atomic<int> numReaders(0);
+	std::atomic<int> numWriters(0);
+	std::atomic<int> numViolations(0);
+	std::atomic<int> numFinished(0);
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < 500; ++i)
+		{
+			if (i % 4 == 0)
+			{
+				mutex.task(ast::Light, [&]() {
+					if (numWriters.fetch_add(1) != 0 || numReaders.load() != 0)
+						numViolations.fetch_add(1);
+
+					std::this_thread::yield();
+					numWriters.fetch_sub(1);
+				})
+				.finished([&]() { numFinished.fetch_add(1); })
+				.start();
+			}
+			else
+			{
+				mutex.sharedTask(ast::Light, [&]() {
+					numReaders.fetch_add(1);
+
+					if (numWriters.load() != 0)
+						numViolations.fetch_add(1);
+
+					std::this_thread::yield();
+					numReaders.fetch_sub(1);
+				})
+				.finished([&]() { numFinished.fetch_add(1); })
+				.start();
+			}
+		}
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numFinished.load(), 500);
+	EXPECT_EQ(numViolations.load(), 0);
+}
+
+static std::string runMutexPolicyScenario(ast::Service& service, ast::MutexPolicy policy)
+{
+	ast::Mutex mutex(service, policy);
+	std::string order;
+	std::mutex orderMutex;
+	std::atomic<bool> isHolderRunning(false);
+	std::atomic<bool> release(false);
+
+	auto log = [&](char name) {
+		std::lock_guard<std::mutex> lock(orderMutex);
+		order.push_back(name);
+	};
+
+	mutex.rootTask(ast::Light, [&]() {
+		log('W');
+		isHolderRunning = true;
+
+		while (!release)
+			std::this_thread::yield();
+	}).start();
+
+	while (!isHolderRunning)
+		std::this_thread::yield();
+
+	// all of them are queued behind the holder
+	mutex.sharedRootTask(ast::Light, [&]() { log('r'); }).start();
+	mutex.rootTask(ast::Light, [&]() { log('w'); }).start();
+	mutex.sharedRootTask(ast::Light, [&]() { log('r'); }).start();
+	mutex.sharedRootTask(ast::Light, [&]() { log('r'); }).start();
+
+	release = true;
+	service.waitUtilEverythingIsDone();
+	return order;
+}
+
+TEST_F(AsyncTreeFunctional, MutexPoliciesOrderQueuedTasks)
+{
+	EXPECT_EQ(runMutexPolicyScenario(*service_, ast::MutexPolicy::Fifo), "Wrwrr");
+	EXPECT_EQ(runMutexPolicyScenario(*service_, ast::MutexPolicy::PreferWriters), "Wwrrr");
+	EXPECT_EQ(runMutexPolicyScenario(*service_, ast::MutexPolicy::BatchReaders), "Wrrrw");
+}
+
+TEST_F(AsyncTreeFunctional, LockAllHoldsEveryMutex)
+{
+	ast::Mutex first(*service_);
+	ast::Mutex second(*service_);
+	std::atomic<int> firstOwners(0);
+	std::atomic<int> secondOwners(0);
+	std::atomic<int> numViolations(0);
+	std::atomic<int> numFinished(0);
+
+	auto own = [&](std::atomic<int>& owners) {
+		if (owners.fetch_add(1) != 0)
+			numViolations.fetch_add(1);
+	};
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < 300; ++i)
+		{
+			auto countFinished = [&]() { numFinished.fetch_add(1); };
+
+			switch (i % 3)
+			{
+			case 0:
+				ast::lockAll(second, first).task(ast::Light, [&]() {
+					own(firstOwners);
+					own(secondOwners);
+					std::this_thread::yield();
+					firstOwners.fetch_sub(1);
+					secondOwners.fetch_sub(1);
+				}).finished(countFinished).start();
+				break;
+
+			case 1:
+				first.task(ast::Light, [&]() {
+					own(firstOwners);
+					std::this_thread::yield();
+					firstOwners.fetch_sub(1);
+				}).finished(countFinished).start();
+				break;
+
+			case 2:
+				second.task(ast::Light, [&]() {
+					own(secondOwners);
+					std::this_thread::yield();
+					secondOwners.fetch_sub(1);
+				}).finished(countFinished).start();
+				break;
+			}
+		}
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numFinished.load(), 300);
+	EXPECT_EQ(numViolations.load(), 0);
+}
+
+TEST_F(AsyncTreeFunctional, KeyedMutexSerializesPerKey)
+{
+	const int numKeys = 10;
+	ast::KeyedMutex<int> mutex(*service_, ast::MutexPolicy::Fifo, 4);
+	std::vector<int> counters(numKeys, 0);
+	std::vector<std::atomic<int>> owners(numKeys);
+	std::atomic<int> numViolations(0);
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < 1000; ++i)
+		{
+			const int key = i % numKeys;
+
+			mutex.task(key, ast::Light, [&, key]() {
+				if (owners[key].fetch_add(1) != 0)
+					numViolations.fetch_add(1);
+
+				++counters[key];
+				owners[key].fetch_sub(1);
+			}).start();
+		}
+	})
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numViolations.load(), 0);
+	EXPECT_EQ(std::accumulate(counters.begin(), counters.end(), 0), 1000);
+	EXPECT_EQ(mutex.numActiveKeys(), 0u);
+}
+
+TEST_F(AsyncTreeFunctional, KeyedMutexWaitsOnlyForStartedTasks)
+{
+	ast::KeyedMutex<int> mutex(*service_);
+	bool isLateRun = false;
+	bool isRun = false;
+
+	// created, but not started yet
+	auto& late = mutex.task(1, ast::Light, [&]() { isLateRun = true; });
+
+	mutex.task(1, ast::Light, [&]() { isRun = true; }).start();
+	service_->waitUtilEverythingIsDone();
+
+	// the destructor would return now, the unstarted task doesn't keep the key active
+	EXPECT_TRUE(isRun);
+	EXPECT_EQ(mutex.numActiveKeys(), 0u);
+
+	// entry of the key is still valid for the task
+	late.start();
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isLateRun);
+	EXPECT_EQ(mutex.numActiveKeys(), 0u);
+}
+
+TEST_F(AsyncTreeFunctional, RetiredMutexDeletesItselfAfterLastTask)
+{
+	std::atomic<int> numFinished(0);
+	std::atomic<bool> isRetired(false);
+	bool isRetiredBeforeTasks = true;
+
+	auto* mutex = new ast::Mutex(*service_);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		mutex->rootTask(ast::Light, [&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			numFinished.fetch_add(1);
+		}).start();
+	}
+
+	// doesn't wait for the tasks
+	mutex->retire([&]() { isRetired = true; });
+	isRetiredBeforeTasks = isRetired.load() && numFinished.load() < 4;
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_FALSE(isRetiredBeforeTasks);
+	EXPECT_EQ(numFinished.load(), 4);
+	EXPECT_TRUE(isRetired.load());
+
+	// idle mutex is deleted at once
+	bool isIdleRetired = false;
+	(new ast::Mutex(*service_))->retire([&]() { isIdleRetired = true; });
+	EXPECT_TRUE(isIdleRetired);
+}
+
+TEST_F(AsyncTreeFunctional, RetiredMutexWaitsForStartedTasks)
+{
+	std::promise<void> gateReleased;
+	std::shared_future<void> gateFuture = gateReleased.get_future().share();
+	std::atomic<int> numRun(0);
+	std::atomic<bool> isRetired(false);
+
+	auto* mutex = new ast::Mutex(*service_);
+	ast::Mutex other(*service_);
+
+	// holds the other mutex and blocks the join until released
+	auto gate = other.rootTask(ast::Light, [gateFuture]() { gateFuture.wait(); }).start();
+
+	mutex->rootTask(ast::Light, [&]() { ++numRun; }).after(*gate).start();
+	ast::lockAll(*mutex, other).task(ast::Light, [&]() { ++numRun; }).start();
+
+	// neither task has touched the mutex yet, but both will
+	mutex->retire([&]() { isRetired = true; });
+	EXPECT_FALSE(isRetired.load());
+
+	gateReleased.set_value();
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numRun.load(), 2);
+	EXPECT_TRUE(isRetired.load());
+}
+
+TEST_F(AsyncTreeFunctional, MutexSubtreeInheritsGrant)
+{
+	ast::Mutex mutex(*service_);
+	std::atomic<bool> isOuterHeld(false);
+	std::atomic<int> numInherited(0);
+	bool wasOverlapped = false;
+
+	mutex.rootTask(ast::Light, [&]() {
+		isOuterHeld = true;
+
+		// would wait for its own parent without inheritance
+		for (int i = 0; i < 4; ++i)
+		{
+			mutex.inheritedTask(ast::Light, [&]() {
+				mutex.sharedInheritedTask(ast::Light, [&]() {
+					std::this_thread::sleep_for(std::chrono::milliseconds(2));
+					numInherited += isOuterHeld.load();
+				}).start();
+			}).start();
+		}
+	},
+	ast::finished([&]() {
+		isOuterHeld = false;
+	})).start();
+
+	mutex.rootTask(ast::Light, [&]() {
+		wasOverlapped = isOuterHeld.load();
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numInherited.load(), 4);
+	EXPECT_FALSE(wasOverlapped);
+}
+
+TEST_F(AsyncTreeFunctional, SharedMutexSubtreeDoesntWaitForQueuedWriter)
+{
+	ast::Mutex mutex(*service_);
+	std::atomic<bool> isWriterQueued(false);
+	std::string order;
+
+	mutex.sharedRootTask(ast::Light, [&]() {
+		while (!isWriterQueued)
+			std::this_thread::yield();
+
+		// a queued writer blocks new readers, but not the ones inheriting the grant
+		mutex.sharedInheritedTask(ast::Light, [&]() { order += 'r'; }).start();
+	}).start();
+
+	mutex.rootTask(ast::Light, [&]() { order += 'w'; }).start();
+	isWriterQueued = true;
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(order, "rw");
+}
+
+TEST_F(AsyncTreeFunctional, MutexRejectsInheritanceWithoutCoveringGrant)
+{
+	ast::Mutex mutex(*service_);
+	std::atomic<int> numRejected(0);
+	std::atomic<bool> hasRun(false);
+
+	auto rejected = [&](std::exception_ptr exception) {
+		try
+		{
+			std::rethrow_exception(exception);
+		}
+		catch (const std::logic_error&)
+		{
+			++numRejected;
+		}
+	};
+
+	mutex.sharedRootTask(ast::Light, [&]() {
+		// upgrade of a shared grant
+		mutex.inheritedTask(ast::Light, [&]() { hasRun = true; }, ast::failed(rejected)).start();
+	}).start();
+
+	// nothing to inherit from
+	service_->task(ast::Light, [&]() {
+		mutex.sharedInheritedTask(ast::Light, [&]() { hasRun = true; }, ast::failed(rejected)).start();
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numRejected.load(), 2);
+	EXPECT_FALSE(hasRun.load());
+
+	// the mutex isn't released by rejected tasks
+	bool isExclusiveRun = false;
+	mutex.rootTask(ast::Light, [&]() { isExclusiveRun = true; }).start();
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isExclusiveRun);
+}
+
+TEST_F(AsyncTreeFunctional, EventTasksWaitWithoutWorkers)
+{
+	ast::Event event(*service_);
+	std::atomic<int> numSucceeded(0);
+	std::atomic<bool> isSetBeforeRun(true);
+	bool isWaiterInterrupted = false;
+
+	// more waiters than workers, the task setting the event still gets a worker
+	const int numWaiters = int(service_->numThreads()) * 4;
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < numWaiters; ++i)
+		{
+			event.task(ast::Heavy, [&]() {
+				if (!event.isSet())
+					isSetBeforeRun = false;
+			},
+			ast::succeeded([&]() { ++numSucceeded; })).start();
+		}
+	}).start();
+
+	service_->task(ast::Light, [&]() { event.set(); }).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numSucceeded.load(), numWaiters);
+	EXPECT_TRUE(isSetBeforeRun.load());
+
+	// waiters of a destroyed event are interrupted
+	{
+		ast::Event unsetEvent(*service_);
+		unsetEvent.rootTask(ast::Light, []() {},
+			ast::interrupted([&]() { isWaiterInterrupted = true; })).start();
+	}
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isWaiterInterrupted);
+}
+
+TEST_F(AsyncTreeFunctional, EventReleasesInterruptedWaiters)
+{
+	ast::Event event(*service_);
+	std::atomic<int> numInterrupted(0);
+	bool isOtherTreeRun = false;
+	bool isRootFinished = false;
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < 4; ++i)
+			event.task(ast::Light, []() {}, ast::interrupted([&]() { ++numInterrupted; })).start();
+
+		service_->task(ast::Light, []() {
+			ast::Service::currentTask()->interruptUpwards();
+		}).start();
+	},
+	ast::finished([&]() { isRootFinished = true; })).start();
+
+	// waiters of other trees keep waiting
+	event.rootTask(ast::Light, [&]() { isOtherTreeRun = true; }).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isRootFinished);
+	EXPECT_EQ(numInterrupted.load(), 4);
+	EXPECT_FALSE(isOtherTreeRun);
+
+	event.set();
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isOtherTreeRun);
+}
+
+TEST_F(AsyncTreeFunctional, LatchStartsTasksAfterCountDown)
+{
+	ast::Latch latch(*service_, 3);
+	std::atomic<int> numCounted(0);
+	int numCountedBeforeWaiter = -1;
+
+	latch.rootTask(ast::Light, [&]() {
+		numCountedBeforeWaiter = numCounted.load();
+	}).start();
+
+	for (int i = 0; i < 3; ++i)
+	{
+		service_->task(ast::Light, [&]() {
+			++numCounted;
+			latch.countDown();
+		}).start();
+	}
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(latch.isReady());
+	EXPECT_EQ(numCountedBeforeWaiter, 3);
+}
+
+TEST_F(AsyncTreeFunctional, BarrierRunsPhasesInOneTree)
+{
+	const int numParticipants = 4;
+	const int numPhases = 10;
+
+	std::atomic<int> numCompletedPhases(0);
+	ast::Barrier barrier(*service_, numParticipants, [&]() { ++numCompletedPhases; });
+
+	std::atomic<int> values[numParticipants] = {};
+	std::atomic<bool> isPhaseMixed(false);
+
+	std::function<void(int, int)> runPhase = [&](int participant, int phase) {
+		// every participant of the previous phase is done
+		for (auto& value : values)
+		{
+			if (value.load() < phase)
+				isPhaseMixed = true;
+		}
+
+		++values[participant];
+
+		if (phase + 1 < numPhases)
+			barrier.arriveAndTask(ast::Light, [&, participant, phase]() { runPhase(participant, phase + 1); }).start();
+		else
+			barrier.arriveAndDrop();
+	};
+
+	bool isRootSucceeded = false;
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < numParticipants; ++i)
+			service_->task(ast::Light, [&, i]() { runPhase(i, 0); }).start();
+	},
+	ast::succeeded([&]() { isRootSucceeded = true; })).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_TRUE(isRootSucceeded);
+	EXPECT_FALSE(isPhaseMixed.load());
+	EXPECT_EQ(numCompletedPhases.load(), numPhases);
+	EXPECT_EQ(barrier.phase(), uint(numPhases));
+
+	for (auto& value : values)
+		EXPECT_EQ(value.load(), numPhases);
+}
+
+TEST_F(AsyncTreeFunctional, ExceptionFailsTask)
+{
+	std::string staticMessage;
+	std::string dynamicMessage;
+	bool isInterrupted = false;
+	bool isSucceeded = false;
+
+	auto message = [](std::exception_ptr exception) {
+		try
+		{
+			std::rethrow_exception(exception);
+		}
+		catch (const std::exception& e)
+		{
+			return std::string(e.what());
+		}
+	};
+
+	service_->task(ast::Light, []() { throw std::runtime_error("failure"); },
+		ast::failed([&](std::exception_ptr exception) { staticMessage = message(exception); }),
+		ast::succeeded([&]() { isSucceeded = true; }))
+	.failed([&](std::exception_ptr exception) { dynamicMessage = message(exception); })
+	.interrupted([&]() { isInterrupted = true; })
+	.start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(staticMessage, "failure");
+	EXPECT_EQ(dynamicMessage, "failure");
+	EXPECT_TRUE(isInterrupted);
+	EXPECT_FALSE(isSucceeded);
+}
+
+TEST_F(AsyncTreeFunctional, PropagatedFailureInterruptsSiblings)
+{
+	std::atomic<int> numSiblingsInterrupted(0);
+	std::exception_ptr rootException;
+	std::atomic<bool> isStopped(false);
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < 3; ++i)
+		{
+			service_->task(ast::Light, [&]() {
+				// would spin until the end of the test without the interruption
+				while (!ast::Service::currentTask()->isInterrupted() && !isStopped)
+					std::this_thread::yield();
+			},
+			ast::interrupted([&]() { ++numSiblingsInterrupted; })).start();
+		}
+
+		service_->task(ast::Light, [&]() {
+			service_->task(ast::Light, []() { throw std::logic_error("deep failure"); })
+				.propagateFailure()
+				.start();
+		})
+		.propagateFailure()
+		.start();
+	})
+	.failed([&](std::exception_ptr exception) { rootException = exception; })
+	.start();
+
+	// fails the test instead of hanging it if siblings aren't interrupted
+	std::thread watchdog([&]() {
+		for (int i = 0; i < 500 && numSiblingsInterrupted < 3; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		isStopped = true;
+	});
+
+	service_->waitUtilEverythingIsDone();
+	watchdog.join();
+
+	EXPECT_EQ(numSiblingsInterrupted.load(), 3);
+	ASSERT_TRUE(rootException);
+	EXPECT_THROW(std::rethrow_exception(rootException), std::logic_error);
+}
+
+TEST_F(AsyncTreeFunctional, SharedResultTaskComputesOnce)
+{
+	std::atomic<int> numComputed(0);
+	std::atomic<int> sum(0);
+	std::atomic<bool> isReleased(false);
+
+	auto compute = [&]() {
+		++numComputed;
+
+		while (!isReleased)
+			std::this_thread::yield();
+
+		return 42;
+	};
+
+	for (int i = 0; i < 8; ++i)
+	{
+		service_->sharedResultTask(std::string("answer"), ast::Light, compute,
+			ast::succeeded([&](int result) { sum += result; })).start();
+	}
+
+	isReleased = true;
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numComputed.load(), 1);
+	EXPECT_EQ(sum.load(), 8 * 42);
+
+	// finished flights aren't reused without a ttl
+	service_->sharedResultTask(std::string("answer"), ast::Light, compute).start();
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numComputed.load(), 2);
+}
+
+TEST_F(AsyncTreeFunctional, SharedResultFlightOutlivesInterruptedCaller)
+{
+	std::atomic<int> numComputed(0);
+	std::atomic<bool> isReleased(false);
+	bool isFirstInterrupted = false;
+	int secondResult = 0;
+
+	auto compute = [&]() {
+		++numComputed;
+
+		while (!isReleased)
+			std::this_thread::yield();
+
+		return 42;
+	};
+
+	auto& first = service_->sharedResultTask(std::string("answer"), ast::Light, compute,
+		ast::interrupted([&]() { isFirstInterrupted = true; }));
+	service_->sharedResultTask(std::string("answer"), ast::Light, compute,
+		ast::succeeded([&](int result) { secondResult = result; })).start();
+
+	// the caller which started the flight gives up, the other one still gets the result
+	first.start()->interruptDownwards();
+
+	isReleased = true;
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numComputed.load(), 1);
+	EXPECT_TRUE(isFirstInterrupted);
+	EXPECT_EQ(secondResult, 42);
+}
+
+TEST_F(AsyncTreeFunctional, CachedResultTaskReusesResultUntilExpired)
+{
+	std::atomic<int> numComputed(0);
+	std::atomic<int> numFailed(0);
+	std::vector<int> results;
+	std::mutex resultsMutex;
+
+	auto request = [&](int key, std::chrono::milliseconds ttl) {
+		service_->cachedResultTask(key, ttl, ast::Light, [&numComputed, key]() {
+			++numComputed;
+
+			if (key < 0)
+				throw std::runtime_error("negative key");
+
+			return key * 2;
+		},
+		ast::succeeded([&](int result) {
+			std::lock_guard<std::mutex> lock(resultsMutex);
+			results.push_back(result);
+		}),
+		ast::failed([&]() { ++numFailed; })).start();
+		service_->waitUtilEverythingIsDone();
+	};
+
+	request(1, std::chrono::milliseconds(10000));
+	request(1, std::chrono::milliseconds(10000));
+	EXPECT_EQ(numComputed.load(), 1);
+
+	// expired result is computed again
+	request(2, std::chrono::milliseconds(0));
+	request(2, std::chrono::milliseconds(0));
+	EXPECT_EQ(numComputed.load(), 3);
+
+	// failures aren't cached
+	request(-1, std::chrono::milliseconds(10000));
+	request(-1, std::chrono::milliseconds(10000));
+	EXPECT_EQ(numComputed.load(), 5);
+	EXPECT_EQ(numFailed.load(), 2);
+
+	EXPECT_EQ(results, std::vector<int>({ 2, 2, 4, 4 }));
+}
+
+TEST_F(AsyncTreeFunctional, InterruptionPurgesQueuedDescendants)
+{
+	const int numChildren = 2000;
+
+	std::atomic<bool> release(false);
+	std::atomic<int> numStarted(0);
+	std::atomic<int> numInterrupted(0);
+	int numInterruptedAtReturn = 0;
+
+	// with the parent they occupy all threads and the light limit, so no child is moved to workers
+	for (uint i = 1; i < service_->numThreads(); ++i)
+	{
+		service_->task(ast::Light, [&]() {
+			while (!release.load())
+				std::this_thread::yield();
+		}).start();
+	}
+
+	service_->task(ast::Light, [&]() {
+		for (int i = 0; i < numChildren; ++i)
+		{
+			service_->task(ast::Light, [&]() { ++numStarted; },
+			ast::interrupted([&]() { ++numInterrupted; })).start();
+		}
+
+		// queued children are finished before interruptDownwards() returns
+		ast::Service::currentTask()->interruptDownwards();
+		numInterruptedAtReturn = numInterrupted.load();
+		release.store(true);
+	}).start();
+
+	service_->waitUtilEverythingIsDone();
+	EXPECT_EQ(numStarted.load(), 0);
+	EXPECT_EQ(numInterruptedAtReturn, numChildren);
+	EXPECT_EQ(numInterrupted.load(), numChildren);
+}